@@ -0,0 +1,1676 @@
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <cmath>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../bvh/bvh.h"
+
+
+static uint64_t rand64() {
+  static uint64_t x = 12345;
+  x ^= x >> 12; // a
+  x ^= x << 25; // b
+  x ^= x >> 27; // c
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+static inline float randf() {
+  return float(rand64() & 0xffff) / float(0xffff);
+}
+
+static inline float randf(float val) {
+  return val * float(rand64() & 0xffff) / float(0xffff);
+}
+
+// make a random box somewhere in a square world
+static bvh::aabb_t random_aabb(float world, float max_size) {
+  const float x = randf(world);
+  const float y = randf(world);
+  const float s = randf(max_size);
+  return bvh::aabb_t{ x - s, y - s, x + s, y + s };
+}
+
+// describes the memory cost of one node layout for capacity planning
+struct layout_t {
+  const char *name;
+  // bytes per interior node
+  size_t node_size;
+  // bytes per leaf node
+  size_t leaf_size;
+  // bytes of payload stored per proxy outside of the nodes
+  size_t payload_size;
+  // bytes of side data stored per node
+  size_t side_per_node;
+  // bytes of side data and scratch space which do not grow with the tree
+  size_t fixed;
+};
+
+static void print_usage(const char *what, const bvh::memory_usage_t &m) {
+  printf("%s\n", what);
+  printf("  nodes used      %10zu bytes\n", m.nodes_used);
+  printf("  nodes reserved  %10zu bytes\n", m.nodes_reserved);
+  printf("  scratch         %10zu bytes\n", m.scratch);
+  printf("  payload         %10zu bytes\n", m.payload);
+  printf("  side            %10zu bytes\n", m.side);
+  printf("  side per node   %10zu bytes\n", m.side_per_node);
+  printf("  total           %10zu bytes\n", m.total());
+}
+
+// report the memory used by a populated tree and project it out to larger
+// proxy counts for each of the available node layouts
+static int bench_memory(int argc, char **args) {
+
+  std::vector<size_t> targets;
+  for (int i = 0; i < argc; ++i) {
+    targets.push_back(size_t(strtoull(args[i], nullptr, 10)));
+  }
+  if (targets.empty()) {
+    targets = { 1000, 10000, 100000, 300000, 1000000 };
+  }
+
+  // the tree is too large to live on the stack
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+
+  print_usage("empty tree", tree->memory_usage());
+
+  const size_t proxies = bvh::bvh_t::capacity() / 2;
+  for (size_t i = 0; i < proxies; ++i) {
+    tree->insert(random_aabb(4096.f, 16.f), nullptr);
+  }
+  char what[64];
+  snprintf(what, sizeof(what), "tree with %zu proxies", proxies);
+  print_usage(what, tree->memory_usage());
+
+  const bvh::memory_usage_t m = tree->memory_usage();
+  // the per node side arrays are sized for the full capacity, so take them
+  // out of the fixed part and scale them with the projected nodes instead
+  const size_t fixed = m.scratch + m.side -
+                       m.side_per_node * bvh::bvh_t::capacity();
+  // a packed tree is a read only copy with no side data of its own
+  const layout_t layouts[] = {
+    { "node_t", sizeof(bvh::node_t), sizeof(bvh::node_t), 0,
+      m.side_per_node, fixed },
+    { "packed", sizeof(bvh::packed_node_t), sizeof(bvh::packed_leaf_t), 0,
+      0, 0 },
+  };
+
+  printf("\nprojected memory (bytes)\n");
+  printf("%-12s %12s %14s %14s\n", "layout", "proxies", "nodes", "total");
+  for (const layout_t &l : layouts) {
+    for (size_t n : targets) {
+      // a binary tree of n leaves has n-1 interior nodes
+      const size_t nodes = n ? (n - 1) * l.node_size + n * l.leaf_size : 0;
+      const size_t side = n ? (2 * n - 1) * l.side_per_node : 0;
+      const size_t total = nodes + n * l.payload_size + side + l.fixed;
+      printf("%-12s %12zu %14zu %14zu\n", l.name, n, nodes, total);
+    }
+  }
+  return 0;
+}
+
+// seconds elapsed since some start time
+static double elapsed(std::chrono::steady_clock::time_point start) {
+  const auto now = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(now - start).count();
+}
+
+// make a wave of boxes clustered around a spawn point
+static std::vector<bvh::aabb_t> spawn_wave(size_t count, float x, float y) {
+  std::vector<bvh::aabb_t> out(count);
+  for (auto &a : out) {
+    const float px = x + randf(256.f);
+    const float py = y + randf(256.f);
+    const float s = 1.f + randf(2.f);
+    a = bvh::aabb_t{ px - s, py - s, px + s, py + s };
+  }
+  return out;
+}
+
+// nodes visited per query by a set of query boxes
+static double nodes_per_query(bvh::bvh_t &tree,
+                              const std::vector<bvh::aabb_t> &queries) {
+  std::vector<bvh::index_t> overlaps;
+  const uint64_t nodes = tree.frame_stats().query_nodes;
+  for (const auto &q : queries) {
+    overlaps.clear();
+    tree.find_overlaps(q, overlaps);
+  }
+  const uint64_t visited = tree.frame_stats().query_nodes - nodes;
+  return double(visited) / double(queries.size());
+}
+
+// compare inserting a wave one at a time against insert_batch, both for a
+// wave clustered around a spawn point and one spread over the whole world
+static int bench_batch(int argc, char **args) {
+
+  const size_t existing = 4096;
+  const size_t wave = (argc > 0) ? size_t(atoi(args[0])) : 8192;
+
+  std::vector<bvh::aabb_t> world(existing);
+  for (auto &a : world) {
+    a = random_aabb(4096.f, 16.f);
+  }
+  std::vector<bvh::aabb_t> queries(4096);
+  for (auto &q : queries) {
+    q = random_aabb(4096.f, 32.f);
+  }
+  std::vector<bvh::aabb_t> spread(wave);
+  for (auto &a : spread) {
+    a = random_aabb(4096.f, 16.f);
+  }
+  struct wave_t {
+    const char *name;
+    std::vector<bvh::aabb_t> boxes;
+  };
+  const wave_t waves[] = {
+    { "clustered", spawn_wave(wave, 1024.f, 1024.f) },
+    { "spread", spread },
+  };
+
+  printf("%-10s %-14s %10s %14s %12s\n", "wave", "method", "ms", "quality",
+         "nodes/query");
+  for (const wave_t &w : waves) {
+    std::unique_ptr<bvh::bvh_t> single(new bvh::bvh_t);
+    std::unique_ptr<bvh::bvh_t> batch(new bvh::bvh_t);
+    for (const auto &a : world) {
+      single->insert(a, nullptr);
+      batch->insert(a, nullptr);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &a : w.boxes) {
+      single->insert(a, nullptr);
+    }
+    const double t_single = elapsed(start);
+
+    std::vector<bvh::index_t> handles;
+    start = std::chrono::steady_clock::now();
+    batch->insert_batch(w.boxes, {}, handles);
+    const double t_batch = elapsed(start);
+
+    printf("%-10s %-14s %10.3f %14.0f %12.1f\n", w.name, "insert",
+           t_single * 1e3, single->quality(),
+           nodes_per_query(*single, queries));
+    printf("%-10s %-14s %10.3f %14.0f %12.1f\n", w.name, "insert_batch",
+           t_batch * 1e3, batch->quality(), nodes_per_query(*batch, queries));
+  }
+  return 0;
+}
+
+// compare despawning part of the world one at a time against remove_batch
+static int bench_despawn(int argc, char **args) {
+
+  const size_t existing = bvh::bvh_t::capacity() / 2;
+  const size_t despawn = (argc > 0) ? size_t(atoi(args[0])) : 4096;
+
+  std::vector<bvh::aabb_t> world(existing);
+  for (auto &a : world) {
+    a = random_aabb(4096.f, 16.f);
+  }
+
+  std::unique_ptr<bvh::bvh_t> single(new bvh::bvh_t);
+  std::unique_ptr<bvh::bvh_t> batch(new bvh::bvh_t);
+  std::unique_ptr<bvh::bvh_t> lazy(new bvh::bvh_t);
+  std::vector<bvh::index_t> h_single, h_batch, h_lazy;
+  single->insert_batch(world, {}, h_single);
+  batch->insert_batch(world, {}, h_batch);
+  lazy->insert_batch(world, {}, h_lazy);
+  h_single.resize(std::min(despawn, existing));
+  h_batch.resize(std::min(despawn, existing));
+  h_lazy.resize(std::min(despawn, existing));
+
+  auto start = std::chrono::steady_clock::now();
+  for (bvh::index_t i : h_single) {
+    single->remove(i);
+  }
+  const double t_single = elapsed(start);
+
+  start = std::chrono::steady_clock::now();
+  batch->remove_batch(h_batch);
+  const double t_batch = elapsed(start);
+
+  // the burst only marks leaves dead and the cleanup comes later
+  start = std::chrono::steady_clock::now();
+  for (bvh::index_t i : h_lazy) {
+    lazy->kill(i);
+  }
+  const double t_kill = elapsed(start);
+  const float q_kill = lazy->quality();
+
+  start = std::chrono::steady_clock::now();
+  lazy->cleanup(0);
+  const double t_cleanup = elapsed(start);
+
+  printf("%-14s %10s %14s\n", "method", "ms", "quality");
+  printf("%-14s %10.3f %14.0f\n", "remove", t_single * 1e3, single->quality());
+  printf("%-14s %10.3f %14.0f\n", "remove_batch", t_batch * 1e3,
+         batch->quality());
+  printf("%-14s %10.3f %14.0f\n", "kill", t_kill * 1e3, q_kill);
+  printf("%-14s %10.3f %14.0f\n", "cleanup", t_cleanup * 1e3,
+         lazy->quality());
+  return 0;
+}
+
+// a box bouncing around a square world
+struct mover_t {
+  float x, y;
+  float dx, dy;
+  float size;
+
+  void make(float world, float speed) {
+    x = randf(world);
+    y = randf(world);
+    dx = (1.f - randf() * 2.f) * speed;
+    dy = (1.f - randf() * 2.f) * speed;
+    size = 1.f + randf(8.f);
+  }
+
+  void tick(float world) {
+    if (x < 0     && dx < 0) dx *= -1.f;
+    if (x > world && dx > 0) dx *= -1.f;
+    if (y < 0     && dy < 0) dy *= -1.f;
+    if (y > world && dy > 0) dy *= -1.f;
+    x += dx;
+    y += dy;
+  }
+
+  bvh::aabb_t aabb() const {
+    return bvh::aabb_t{ x - size, y - size, x + size, y + size };
+  }
+};
+
+// run a simple simulation of movers and queries over a number of frames,
+// returning the time taken
+static double simulate(bvh::bvh_t &tree, std::vector<mover_t> &movers,
+                       size_t frames, size_t queries, bool adaptive) {
+  const float world = 4096.f;
+  std::vector<bvh::index_t> handles(movers.size());
+  for (size_t i = 0; i < movers.size(); ++i) {
+    handles[i] = tree.insert(movers[i].aabb(), &movers[i]);
+  }
+  std::vector<bvh::index_t> found;
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t f = 0; f < frames; ++f) {
+    for (size_t i = 0; i < movers.size(); ++i) {
+      movers[i].tick(world);
+      tree.move(handles[i], movers[i].aabb());
+    }
+    for (size_t q = 0; q < queries; ++q) {
+      found.clear();
+      tree.find_overlaps(random_aabb(world, 64.f), found);
+    }
+    if (adaptive) {
+      tree.end_frame();
+    }
+  }
+  return elapsed(start);
+}
+
+// compare the fixed reinsertion policy against the adaptive scheduler
+static int bench_maintain(int argc, char **args) {
+
+  const size_t count = 8192;
+  const size_t frames = (argc > 0) ? size_t(atoi(args[0])) : 600;
+  const size_t queries = (argc > 1) ? size_t(atoi(args[1])) : 256;
+
+  std::vector<mover_t> movers(count);
+  for (auto &m : movers) {
+    m.make(4096.f, 2.f);
+  }
+  std::vector<mover_t> copy = movers;
+
+  std::unique_ptr<bvh::bvh_t> fixed(new bvh::bvh_t);
+  std::unique_ptr<bvh::bvh_t> adaptive(new bvh::bvh_t);
+  const double t_fixed = simulate(*fixed, movers, frames, queries, false);
+  const double t_adaptive = simulate(*adaptive, copy, frames, queries, true);
+
+  size_t decisions[4] = { 0, 0, 0, 0 };
+  for (const bvh::frame_stats_t &f : adaptive->frame_history()) {
+    ++decisions[int(f.decision)];
+  }
+  printf("%-10s %10s %14s\n", "policy", "ms", "quality");
+  printf("%-10s %10.3f %14.0f\n", "reinsert", t_fixed * 1e3, fixed->quality());
+  printf("%-10s %10.3f %14.0f\n", "adaptive", t_adaptive * 1e3,
+         adaptive->quality());
+  printf("\nlast %zu decisions: refit %zu, reinsert %zu, partial %zu, "
+         "full %zu\n", adaptive->frame_history().size(), decisions[0],
+         decisions[1], decisions[2], decisions[3]);
+  return 0;
+}
+
+// churn one corner of the world, then compare repairing just the degraded
+// subtrees against rebuilding the whole tree
+static int bench_churn(int argc, char **args) {
+
+  const size_t count = bvh::bvh_t::capacity() / 2;
+  const size_t churn = (argc > 0) ? size_t(atoi(args[0])) : 20000;
+
+  std::vector<bvh::aabb_t> world(count);
+  for (auto &a : world) {
+    a = random_aabb(4096.f, 8.f);
+  }
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  std::vector<bvh::index_t> handles;
+  tree->insert_batch(world, {}, handles);
+  const float fresh = tree->quality();
+
+  // a battle in one corner keeps teleporting units around it
+  std::vector<bvh::index_t> local;
+  for (size_t i = 0; i < count; ++i) {
+    if (world[i].maxx < 1024.f && world[i].maxy < 1024.f) {
+      local.push_back(handles[i]);
+    }
+  }
+  // refit only maintenance lets the churned region degrade
+  tree->maintenance = bvh::maintenance_t::refit;
+  for (size_t i = 0; i < churn && !local.empty(); ++i) {
+    tree->move(local[rand64() % local.size()], random_aabb(1024.f, 8.f));
+  }
+  const float churned = tree->quality();
+
+  std::unique_ptr<bvh::bvh_t> full(new bvh::bvh_t(*tree));
+
+  auto start = std::chrono::steady_clock::now();
+  const size_t rebuilt = tree->rebuild_degraded(tree->degraded_ratio);
+  const double t_partial = elapsed(start);
+
+  // nothing changed since, so a second search should find nothing to check
+  start = std::chrono::steady_clock::now();
+  tree->rebuild_degraded(tree->degraded_ratio);
+  const double t_recheck = elapsed(start);
+
+  start = std::chrono::steady_clock::now();
+  full->rebuild();
+  const double t_full = elapsed(start);
+
+  printf("quality fresh %.0f, churned %.0f\n\n", fresh, churned);
+  printf("%-10s %10s %14s\n", "method", "ms", "quality");
+  printf("%-10s %10.3f %14.0f (%zu subtrees)\n", "partial", t_partial * 1e3,
+         tree->quality(), rebuilt);
+  printf("%-10s %10.3f\n", "recheck", t_recheck * 1e3);
+  printf("%-10s %10.3f %14.0f\n", "full", t_full * 1e3, full->quality());
+  return 0;
+}
+
+// compare hand picked growth values against the growth tuner
+static int bench_growth(int argc, char **args) {
+
+  const size_t count = 8192;
+  const size_t frames = (argc > 0) ? size_t(atoi(args[0])) : 600;
+  const size_t queries = (argc > 1) ? size_t(atoi(args[1])) : 256;
+
+  std::vector<mover_t> movers(count);
+  for (auto &m : movers) {
+    m.make(4096.f, 2.f);
+  }
+
+  printf("%-10s %10s %10s %10s %10s\n",
+         "growth", "tuned", "ms", "escape", "false +");
+  const float start_growth[] = { 2.f, 16.f, 64.f };
+  for (int tuned = 0; tuned < 2; ++tuned) {
+    for (float g : start_growth) {
+      std::vector<mover_t> copy = movers;
+      std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+      tree->growth = g;
+      tree->auto_growth = tuned != 0;
+      const double t = simulate(*tree, copy, frames, queries, true);
+      uint64_t moves = 0, escapes = 0, hits = 0, fp = 0;
+      for (const bvh::frame_stats_t &f : tree->frame_history()) {
+        moves += f.movers;
+        escapes += f.escapes;
+        hits += f.leaf_hits;
+        fp += f.false_positives;
+      }
+      printf("%-10.2f %10.2f %10.3f %10.4f %10.4f\n", g, tree->growth, t * 1e3,
+             moves ? double(escapes) / double(moves) : 0.,
+             hits ? double(fp) / double(hits) : 0.);
+    }
+  }
+  return 0;
+}
+
+// compare per client visible set deltas from a full query plus a sorted
+// diff against find_overlaps_delta
+static int bench_delta(int argc, char **args) {
+
+  const size_t count = 8192;
+  const size_t clients = 64;
+  const size_t frames = (argc > 0) ? size_t(atoi(args[0])) : 200;
+  // only some of the world moves each frame
+  const size_t moving = (argc > 1) ? size_t(atoi(args[1])) : 256;
+
+  std::vector<mover_t> movers(count);
+  for (auto &m : movers) {
+    m.make(4096.f, 2.f);
+  }
+  std::vector<bvh::aabb_t> views(clients);
+  for (auto &v : views) {
+    v = random_aabb(4096.f, 256.f);
+  }
+
+  for (int delta = 0; delta < 2; ++delta) {
+    std::vector<mover_t> copy = movers;
+    std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+    std::vector<bvh::index_t> handles(count);
+    for (size_t i = 0; i < count; ++i) {
+      handles[i] = tree->insert(copy[i].aabb(), &copy[i]);
+    }
+    std::vector<std::vector<bvh::index_t>> visible(clients);
+    std::vector<bvh::index_t> found, added, removed;
+    size_t changes = 0;
+    uint64_t nodes = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < frames; ++f) {
+      for (size_t i = 0; i < moving; ++i) {
+        copy[i].tick(4096.f);
+        tree->move(handles[i], copy[i].aabb());
+      }
+      for (size_t c = 0; c < clients; ++c) {
+        if (delta) {
+          tree->find_overlaps_delta(uint32_t(c), views[c], added, removed);
+        }
+        else {
+          found.clear();
+          added.clear();
+          removed.clear();
+          tree->find_overlaps(views[c], found);
+          std::sort(found.begin(), found.end());
+          std::set_difference(found.begin(), found.end(),
+                              visible[c].begin(), visible[c].end(),
+                              std::back_inserter(added));
+          std::set_difference(visible[c].begin(), visible[c].end(),
+                              found.begin(), found.end(),
+                              std::back_inserter(removed));
+          visible[c].swap(found);
+        }
+        changes += added.size() + removed.size();
+      }
+      nodes += tree->frame_stats().query_nodes;
+      tree->end_frame();
+    }
+    printf("%-8s %10.3f ms %12llu nodes %10zu changes\n",
+           delta ? "delta" : "full", elapsed(start) * 1e3,
+           (unsigned long long)nodes, changes);
+  }
+  return 0;
+}
+
+// compare rasterizing every unit into an influence grid against walking the
+// tree, single threaded and tiled over threads
+static int bench_raster(int argc, char **args) {
+
+  const int32_t size = (argc > 0) ? atoi(args[0]) : 256;
+  const size_t count = bvh::bvh_t::capacity() / 2;
+  const size_t reps = 32;
+
+  std::vector<bvh::aabb_t> units(count);
+  for (auto &a : units) {
+    a = random_aabb(4096.f, 8.f);
+  }
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  std::vector<bvh::index_t> handles;
+  tree->insert_batch(units, {}, handles);
+
+  std::vector<float> grid(size_t(size) * size);
+
+  // the whole world and then a quarter of it along each axis
+  const bvh::aabb_t areas[] = {
+    { 0.f, 0.f, 4096.f, 4096.f },
+    { 1024.f, 1024.f, 2048.f, 2048.f },
+  };
+  for (const bvh::aabb_t &area : areas) {
+    printf("area %.0f x %.0f, %d x %d cells\n", area.maxx - area.minx,
+           area.maxy - area.miny, size, size);
+    const float cw = (area.maxx - area.minx) / float(size);
+    const float ch = (area.maxy - area.miny) / float(size);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < reps; ++r) {
+      std::fill(grid.begin(), grid.end(), 0.f);
+      for (const auto &a : units) {
+        const int32_t x0 = std::max(int32_t(floorf((a.minx - area.minx) / cw)), 0);
+        const int32_t x1 = std::min(int32_t(floorf((a.maxx - area.minx) / cw)), size - 1);
+        const int32_t y0 = std::max(int32_t(floorf((a.miny - area.miny) / ch)), 0);
+        const int32_t y1 = std::min(int32_t(floorf((a.maxy - area.miny) / ch)), size - 1);
+        for (int32_t y = y0; y <= y1; ++y) {
+          for (int32_t x = x0; x <= x1; ++x) {
+            grid[x + y * size] += 1.f;
+          }
+        }
+      }
+    }
+    printf("  %-10s %10.3f ms\n", "per unit", elapsed(start) * 1e3 / reps);
+
+    std::vector<float> first;
+    const uint32_t threads[] = { 1, 2, 4 };
+    for (uint32_t t : threads) {
+      start = std::chrono::steady_clock::now();
+      for (size_t r = 0; r < reps; ++r) {
+        std::fill(grid.begin(), grid.end(), 0.f);
+        tree->rasterize(area, grid.data(), size, size, t);
+      }
+      const double ms = elapsed(start) * 1e3 / reps;
+      if (first.empty()) {
+        first = grid;
+      }
+      printf("  tree x%-3u %11.3f ms %s\n", t, ms,
+             (grid == first) ? "" : "(differs from x1)");
+    }
+  }
+  printf("(%u hardware threads)\n", std::thread::hardware_concurrency());
+  return 0;
+}
+
+// run batched queries and pair finding over several thread counts, checking
+// the output is identical to a single threaded run
+static int bench_parallel(int argc, char **args) {
+
+  const size_t count = (argc > 0) ? size_t(atoi(args[0])) : 8192;
+  const size_t queries = 1024;
+
+  std::vector<bvh::aabb_t> units(count);
+  for (auto &a : units) {
+    a = random_aabb(4096.f, 16.f);
+  }
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  std::vector<bvh::index_t> handles;
+  tree->insert_batch(units, {}, handles);
+
+  std::vector<bvh::aabb_t> boxes(queries);
+  for (auto &b : boxes) {
+    b = random_aabb(4096.f, 128.f);
+  }
+
+  // single threaded reference results
+  std::vector<std::vector<bvh::index_t>> expect(queries);
+  for (size_t i = 0; i < queries; ++i) {
+    tree->find_overlaps(boxes[i], expect[i]);
+  }
+  std::vector<std::pair<bvh::index_t, bvh::index_t>> expect_pairs;
+  tree->find_pairs(expect_pairs, 1);
+
+  int ret = 0;
+  const uint32_t threads[] = { 1, 2, 4, 8 };
+  for (uint32_t t : threads) {
+    std::vector<std::vector<bvh::index_t>> results;
+    auto start = std::chrono::steady_clock::now();
+    tree->find_overlaps_batch(boxes, results, t);
+    const double query_ms = elapsed(start) * 1e3;
+
+    std::vector<std::pair<bvh::index_t, bvh::index_t>> pairs;
+    start = std::chrono::steady_clock::now();
+    tree->find_pairs(pairs, t);
+    const double pair_ms = elapsed(start) * 1e3;
+
+    const bool same = results == expect && pairs == expect_pairs;
+    printf("x%-3u queries %8.3f ms  pairs %8.3f ms %8zu pairs %s\n", t,
+           query_ms, pair_ms, pairs.size(), same ? "" : "(differs from x1)");
+    ret |= same ? 0 : 1;
+  }
+  return ret;
+}
+
+// update islands from the pairs found each frame, incrementally and from
+// scratch, checking that both give the same islands
+static int bench_islands(int argc, char **args) {
+
+  const size_t count = 8192;
+  const size_t frames = (argc > 0) ? size_t(atoi(args[0])) : 100;
+  const uint32_t threads = (argc > 1) ? uint32_t(atoi(args[1])) : 0;
+
+  std::vector<mover_t> movers(count);
+  for (auto &m : movers) {
+    m.make(8192.f, 2.f);
+  }
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  std::vector<bvh::index_t> handles(count);
+  for (size_t i = 0; i < count; ++i) {
+    handles[i] = tree->insert(movers[i].aabb(), &movers[i]);
+  }
+
+  std::unique_ptr<bvh::island_builder_t> incremental(new bvh::island_builder_t);
+  std::unique_ptr<bvh::island_builder_t> scratch(new bvh::island_builder_t);
+  std::vector<std::pair<bvh::index_t, bvh::index_t>> pairs;
+  double inc_time = 0., full_time = 0.;
+  size_t islands = 0;
+  int ret = 0;
+  for (size_t f = 0; f < frames; ++f) {
+    for (size_t i = 0; i < count; ++i) {
+      movers[i].tick(8192.f);
+      tree->move(handles[i], movers[i].aabb());
+    }
+    tree->find_pairs(pairs, threads);
+
+    auto start = std::chrono::steady_clock::now();
+    incremental->update(pairs, threads);
+    inc_time += elapsed(start);
+
+    start = std::chrono::steady_clock::now();
+    scratch->clear();
+    scratch->update(pairs, threads);
+    full_time += elapsed(start);
+
+    islands += incremental->islands().size();
+    if (incremental->bodies() != scratch->bodies() ||
+        incremental->islands().size() != scratch->islands().size()) {
+      printf("frame %zu: incremental islands differ\n", f);
+      ret = 1;
+      break;
+    }
+    tree->end_frame();
+  }
+  printf("%-12s %10.3f ms\n", "incremental", inc_time * 1e3);
+  printf("%-12s %10.3f ms\n", "scratch", full_time * 1e3);
+  printf("%.1f islands per frame, %zu pairs in the last\n",
+         double(islands) / double(frames), pairs.size());
+  return ret;
+}
+
+// a world where most movers are at rest, updated by calling move() on every
+// proxy and by move_batch() with the resting ones asleep
+static int bench_sleep(int argc, char **args) {
+
+  const size_t count = 8192;
+  const size_t frames = (argc > 0) ? size_t(atoi(args[0])) : 100;
+  // percentage of movers at rest
+  const size_t resting = (argc > 1) ? size_t(atoi(args[1])) : 90;
+
+  std::vector<mover_t> movers(count);
+  for (size_t i = 0; i < count; ++i) {
+    movers[i].make(8192.f, (i * 100 < resting * count) ? 0.f : 2.f);
+  }
+
+  for (int sleeping = 0; sleeping < 2; ++sleeping) {
+    std::vector<mover_t> copy = movers;
+    std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+    std::vector<bvh::index_t> handles(count);
+    std::vector<bvh::aabb_t> boxes(count);
+    for (size_t i = 0; i < count; ++i) {
+      handles[i] = tree->insert(copy[i].aabb(), &copy[i]);
+      if (sleeping && copy[i].dx == 0.f && copy[i].dy == 0.f) {
+        tree->sleep(handles[i]);
+      }
+    }
+    std::vector<std::pair<bvh::index_t, bvh::index_t>> pairs;
+    double move_time = 0., pair_time = 0.;
+    uint64_t moved = 0;
+    for (size_t f = 0; f < frames; ++f) {
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < count; ++i) {
+        copy[i].tick(8192.f);
+        boxes[i] = copy[i].aabb();
+      }
+      if (sleeping) {
+        tree->move_batch(handles, boxes);
+      }
+      else {
+        for (size_t i = 0; i < count; ++i) {
+          tree->move(handles[i], boxes[i]);
+        }
+      }
+      move_time += elapsed(start);
+      moved += tree->frame_stats().movers;
+
+      start = std::chrono::steady_clock::now();
+      tree->find_pairs(pairs, 1);
+      pair_time += elapsed(start);
+      tree->end_frame();
+    }
+    printf("%-8s move %9.3f ms  pairs %9.3f ms %10llu moves %8zu pairs\n",
+           sleeping ? "sleep" : "awake", move_time * 1e3, pair_time * 1e3,
+           (unsigned long long)moved, pairs.size());
+  }
+  return 0;
+}
+
+// trace incoherent rays one at a time in submission order and as a sorted
+// batch, checking both give the same hits
+static int bench_rays(int argc, char **args) {
+
+  const size_t count = (argc > 0) ? size_t(atoi(args[0])) : 200000;
+  const float length = (argc > 1) ? float(atof(args[1])) : 256.f;
+
+  std::vector<bvh::aabb_t> units(bvh::bvh_t::capacity() / 2);
+  for (auto &a : units) {
+    a = random_aabb(4096.f, 16.f);
+  }
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  std::vector<bvh::index_t> handles;
+  tree->insert_batch(units, {}, handles);
+
+  std::vector<bvh::ray_t> rays(count);
+  for (auto &r : rays) {
+    r.x0 = randf(4096.f);
+    r.y0 = randf(4096.f);
+    const float angle = randf(6.2831853f);
+    r.x1 = r.x0 + cosf(angle) * length;
+    r.y1 = r.y0 + sinf(angle) * length;
+  }
+
+  std::vector<std::vector<bvh::index_t>> expect(count);
+  tree->end_frame();
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i) {
+    tree->raycast(rays[i].x0, rays[i].y0, rays[i].x1, rays[i].y1, expect[i]);
+  }
+  const double t_single = elapsed(start);
+  const uint64_t n_single = tree->frame_stats().query_nodes;
+
+  std::vector<std::vector<bvh::index_t>> results;
+  tree->end_frame();
+  start = std::chrono::steady_clock::now();
+  tree->raycast_batch(rays, results);
+  const double t_batch = elapsed(start);
+  const uint64_t n_batch = tree->frame_stats().query_nodes;
+
+  printf("%-14s %12s %14s\n", "method", "rays/s", "nodes");
+  printf("%-14s %12.0f %14llu\n", "raycast", double(count) / t_single,
+         (unsigned long long)n_single);
+  printf("%-14s %12.0f %14llu %s\n", "raycast_batch", double(count) / t_batch,
+         (unsigned long long)n_batch,
+         (results == expect) ? "" : "(differs from raycast)");
+  return (results == expect) ? 0 : 1;
+}
+
+// vision cones answered by a box query and per candidate angle math, against
+// the sector query and its batched form
+static int bench_sector(int argc, char **args) {
+
+  const size_t count = (argc > 0) ? size_t(atoi(args[0])) : 20000;
+  const float radius = (argc > 1) ? float(atof(args[1])) : 160.f;
+
+  std::vector<bvh::aabb_t> units(bvh::bvh_t::capacity() / 2);
+  for (auto &a : units) {
+    a = random_aabb(4096.f, 16.f);
+  }
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  std::vector<bvh::index_t> handles;
+  tree->insert_batch(units, {}, handles);
+
+  // 90 degree cones looking in random directions from random units
+  std::vector<bvh::sector_t> cones(count);
+  for (auto &c : cones) {
+    const bvh::aabb_t &u = units[rand64() % units.size()];
+    const float angle = randf(6.2831853f);
+    c.x = (u.minx + u.maxx) * .5f;
+    c.y = (u.miny + u.maxy) * .5f;
+    c.dx = cosf(angle);
+    c.dy = sinf(angle);
+    c.radius = radius;
+    c.half_angle = .785398f;
+  }
+
+  // bounding box of the circle, then the angle and range of each candidate
+  std::vector<bvh::index_t> candidates;
+  uint64_t n_box = 0, found = 0;
+  tree->end_frame();
+  auto start = std::chrono::steady_clock::now();
+  for (const auto &c : cones) {
+    candidates.clear();
+    tree->find_overlaps(bvh::aabb_t{ c.x - c.radius, c.y - c.radius,
+                                     c.x + c.radius, c.y + c.radius },
+                        candidates);
+    n_box += candidates.size();
+    const float cos_half = cosf(c.half_angle);
+    for (bvh::index_t i : candidates) {
+      const bvh::aabb_t &a = tree->get(i).tight;
+      const float dx = (a.minx + a.maxx) * .5f - c.x;
+      const float dy = (a.miny + a.maxy) * .5f - c.y;
+      const float d = sqrtf(dx * dx + dy * dy);
+      found += (d <= c.radius && dx * c.dx + dy * c.dy >= d * cos_half);
+    }
+  }
+  const double t_box = elapsed(start);
+  const uint64_t nodes_box = tree->frame_stats().query_nodes;
+
+  std::vector<std::vector<bvh::index_t>> expect(count);
+  tree->end_frame();
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i) {
+    tree->find_in_sector(cones[i], expect[i]);
+  }
+  const double t_single = elapsed(start);
+  const uint64_t nodes_single = tree->frame_stats().query_nodes;
+  uint64_t n_single = 0;
+  for (const auto &e : expect) {
+    n_single += e.size();
+  }
+
+  std::vector<std::vector<bvh::index_t>> results;
+  tree->end_frame();
+  start = std::chrono::steady_clock::now();
+  tree->find_in_sector_batch(cones, results);
+  const double t_batch = elapsed(start);
+  const uint64_t nodes_batch = tree->frame_stats().query_nodes;
+
+  printf("%-22s %12s %14s %12s\n", "method", "cones/s", "nodes", "leaves");
+  printf("%-22s %12.0f %14llu %12llu (%llu by center)\n", "box + angle",
+         double(count) / t_box, (unsigned long long)nodes_box,
+         (unsigned long long)n_box, (unsigned long long)found);
+  printf("%-22s %12.0f %14llu %12llu\n", "find_in_sector",
+         double(count) / t_single, (unsigned long long)nodes_single,
+         (unsigned long long)n_single);
+  printf("%-22s %12.0f %14llu %12llu %s\n", "find_in_sector_batch",
+         double(count) / t_batch, (unsigned long long)nodes_batch,
+         (unsigned long long)n_single,
+         (results == expect) ? "" : "(differs from find_in_sector)");
+  return (results == expect) ? 0 : 1;
+}
+
+// the k highest keyed units in a box each tick, by a box query and a partial
+// sort against the best first query, while units move and change their keys
+static int bench_topk(int argc, char **args) {
+
+  const size_t frames = (argc > 0) ? size_t(atoi(args[0])) : 100;
+  const size_t k = (argc > 1) ? size_t(atoi(args[1])) : 5;
+  const size_t count = 8192;
+  const size_t queries = 256;
+
+  std::vector<mover_t> movers(count);
+  for (auto &m : movers) {
+    m.make(4096.f, 1.f);
+  }
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  std::vector<bvh::index_t> handles(count);
+  std::vector<float> keys(count);
+  for (size_t i = 0; i < count; ++i) {
+    handles[i] = tree->insert(movers[i].aabb(), &movers[i]);
+    keys[i] = randf(1.f);
+    tree->set_key(handles[i], keys[i]);
+  }
+
+  double t_keys = 0., t_sort = 0., t_topk = 0.;
+  uint64_t n_sort = 0, n_topk = 0;
+  int ret = 0;
+  std::vector<bvh::index_t> a, b;
+  for (size_t f = 0; f < frames; ++f) {
+    for (size_t i = 0; i < count; ++i) {
+      movers[i].tick(4096.f);
+      tree->move(handles[i], movers[i].aabb());
+    }
+    // an eighth of the units change their threat each tick
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = f % 8; i < count; i += 8) {
+      keys[i] = randf(1.f);
+      tree->set_key(handles[i], keys[i]);
+    }
+    t_keys += elapsed(start);
+    tree->end_frame();
+    for (size_t q = 0; q < queries; ++q) {
+      const bvh::aabb_t bb = random_aabb(4096.f, 1024.f);
+      a.clear();
+      b.clear();
+      start = std::chrono::steady_clock::now();
+      uint64_t nodes = tree->frame_stats().query_nodes;
+      tree->find_overlaps(bb, a);
+      const size_t top = std::min(k, a.size());
+      std::partial_sort(a.begin(), a.begin() + top, a.end(),
+        [&](bvh::index_t x, bvh::index_t y) {
+          return tree->key(x) > tree->key(y);
+        });
+      a.resize(top);
+      t_sort += elapsed(start);
+      n_sort += tree->frame_stats().query_nodes - nodes;
+
+      start = std::chrono::steady_clock::now();
+      nodes = tree->frame_stats().query_nodes;
+      tree->find_top_k(bb, k, b);
+      t_topk += elapsed(start);
+      n_topk += tree->frame_stats().query_nodes - nodes;
+
+      // keys may tie, so compare the keys found rather than the units
+      ret |= (a.size() == b.size()) ? 0 : 1;
+      for (size_t i = 0; i < a.size() && i < b.size(); ++i) {
+        ret |= (tree->key(a[i]) == tree->key(b[i])) ? 0 : 1;
+      }
+    }
+  }
+  const double n = double(frames * queries);
+  printf("%-18s %10s %12s\n", "method", "us/query", "nodes/query");
+  printf("%-18s %10.3f %12.1f\n", "overlaps + sort", t_sort * 1e6 / n,
+         double(n_sort) / n);
+  printf("%-18s %10.3f %12.1f %s\n", "find_top_k", t_topk * 1e6 / n,
+         double(n_topk) / n, ret ? "(results differ)" : "");
+  printf("%-18s %10.3f us/frame\n", "set_key", t_keys * 1e6 / double(frames));
+  return ret;
+}
+
+// take the nearest k leaves to random points with the nearest first iterator,
+// against measuring and sorting every leaf
+static int bench_nearest(int argc, char **args) {
+
+  const size_t queries = (argc > 0) ? size_t(atoi(args[0])) : 1000;
+
+  std::vector<bvh::aabb_t> units(bvh::bvh_t::capacity() / 2);
+  for (auto &a : units) {
+    a = random_aabb(4096.f, 16.f);
+  }
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  std::vector<bvh::index_t> handles;
+  tree->insert_batch(units, {}, handles);
+
+  std::vector<float> px(queries), py(queries);
+  for (size_t q = 0; q < queries; ++q) {
+    px[q] = randf(4096.f);
+    py[q] = randf(4096.f);
+  }
+
+  // every leaf measured and sorted
+  std::vector<float> dist(handles.size());
+  auto start = std::chrono::steady_clock::now();
+  for (size_t q = 0; q < queries; ++q) {
+    for (size_t i = 0; i < handles.size(); ++i) {
+      const bvh::aabb_t &a = tree->get(handles[i]).tight;
+      const float dx = std::max(std::max(a.minx - px[q], px[q] - a.maxx), 0.f);
+      const float dy = std::max(std::max(a.miny - py[q], py[q] - a.maxy), 0.f);
+      dist[i] = dx * dx + dy * dy;
+    }
+    std::sort(dist.begin(), dist.end());
+  }
+  printf("%-10s %10.3f us/query\n", "sort all", elapsed(start) * 1e6 / queries);
+
+  const size_t ks[] = { 1, 8, 64, 512 };
+  for (size_t k : ks) {
+    size_t visited = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t q = 0; q < queries; ++q) {
+      bvh::nearest_t it(*tree, px[q], py[q]);
+      bvh::index_t index;
+      float d;
+      for (size_t n = 0; n < k && it.next(index, d); ++n) {
+      }
+      visited += it.visited();
+    }
+    printf("k=%-8zu %10.3f us/query %10.1f nodes/query\n", k,
+           elapsed(start) * 1e6 / queries, double(visited) / queries);
+  }
+  return 0;
+}
+
+// pick random leaves within large areas by enumerating every overlap and by
+// sampling through the subtree counts
+static int bench_sample(int argc, char **args) {
+
+  const size_t queries = (argc > 0) ? size_t(atoi(args[0])) : 1000;
+  const float area = (argc > 1) ? float(atof(args[1])) : 2048.f;
+
+  std::vector<bvh::aabb_t> units(bvh::bvh_t::capacity() / 2);
+  for (auto &a : units) {
+    a = random_aabb(4096.f, 16.f);
+  }
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  std::vector<bvh::index_t> handles;
+  tree->insert_batch(units, {}, handles);
+
+  std::vector<bvh::aabb_t> boxes(queries);
+  for (auto &b : boxes) {
+    b = random_aabb(4096.f - area, area);
+  }
+  std::mt19937 rng(1234);
+
+  const size_t ks[] = { 1, 16 };
+  for (size_t k : ks) {
+    std::vector<bvh::index_t> found, picked;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &b : boxes) {
+      found.clear();
+      tree->find_overlaps(b, found);
+      for (size_t n = 0; n < k && !found.empty(); ++n) {
+        picked.push_back(found[rng() % found.size()]);
+      }
+    }
+    const double t_enum = elapsed(start);
+
+    start = std::chrono::steady_clock::now();
+    for (const auto &b : boxes) {
+      tree->sample_in_region(b, k, rng, picked);
+    }
+    const double t_sample = elapsed(start);
+
+    printf("k=%-3zu enumerate %9.3f us  sample %9.3f us\n", k,
+           t_enum * 1e6 / queries, t_sample * 1e6 / queries);
+  }
+  return 0;
+}
+
+// run the same overlap queries against the tree and a packed copy of it
+static int bench_packed(int argc, char **args) {
+
+  const size_t queries = (argc > 0) ? size_t(atoi(args[0])) : 100000;
+  const float size = (argc > 1) ? float(atof(args[1])) : 64.f;
+
+  std::vector<bvh::aabb_t> units(bvh::bvh_t::capacity() / 2);
+  for (auto &a : units) {
+    a = random_aabb(4096.f, 16.f);
+  }
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  std::vector<bvh::index_t> handles;
+  tree->insert_batch(units, {}, handles);
+
+  auto start = std::chrono::steady_clock::now();
+  bvh::packed_bvh_t packed;
+  packed.build(*tree);
+  const double t_build = elapsed(start);
+
+  std::vector<bvh::aabb_t> boxes(queries);
+  for (auto &b : boxes) {
+    b = random_aabb(4096.f, size);
+  }
+
+  std::vector<bvh::index_t> a, b;
+  size_t hits = 0;
+  start = std::chrono::steady_clock::now();
+  for (const auto &bb : boxes) {
+    a.clear();
+    tree->find_overlaps(bb, a);
+    hits += a.size();
+  }
+  const double t_tree = elapsed(start);
+
+  start = std::chrono::steady_clock::now();
+  for (const auto &bb : boxes) {
+    b.clear();
+    packed.find_overlaps(bb, b);
+  }
+  const double t_packed = elapsed(start);
+
+  // check the two agree
+  int ret = 0;
+  for (size_t q = 0; q < std::min<size_t>(queries, 1000); ++q) {
+    a.clear();
+    b.clear();
+    tree->find_overlaps(boxes[q], a);
+    packed.find_overlaps(boxes[q], b);
+    std::sort(a.begin(), a.end());
+    std::sort(b.begin(), b.end());
+    ret |= (a == b) ? 0 : 1;
+  }
+
+  printf("%-8s %10.3f us/query %12zu bytes\n", "node_t",
+         t_tree * 1e6 / queries, tree->memory_usage().nodes_used);
+  printf("%-8s %10.3f us/query %12zu bytes %s\n", "packed",
+         t_packed * 1e6 / queries, packed.memory(),
+         ret ? "(differs from node_t)" : "");
+  printf("packed in %.3f ms, %.1f hits per query\n", t_build * 1e3,
+         double(hits) / queries);
+  return ret;
+}
+
+// query throughput from a thread on each numa node, against the copy of the
+// tree on node zero and against the copy local to the thread
+static int bench_numa(int argc, char **args) {
+
+  const size_t queries = (argc > 0) ? size_t(atoi(args[0])) : 200000;
+  const float size = (argc > 1) ? float(atof(args[1])) : 64.f;
+
+  std::vector<bvh::aabb_t> units(bvh::bvh_t::capacity() / 2);
+  for (auto &a : units) {
+    a = random_aabb(4096.f, 16.f);
+  }
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  std::vector<bvh::index_t> handles;
+  tree->insert_batch(units, {}, handles);
+
+  bvh::replicated_bvh_t replicated;
+  auto start = std::chrono::steady_clock::now();
+  replicated.build(*tree);
+  const double t_build = elapsed(start);
+
+  std::vector<bvh::aabb_t> boxes(queries);
+  for (auto &b : boxes) {
+    b = random_aabb(4096.f, size);
+  }
+
+  const size_t nodes = bvh::numa_nodes();
+  printf("%zu numa node(s), %zu copies of %zu bytes built in %.3f ms\n",
+         nodes, replicated.replicas(), replicated.replica(0).memory(),
+         t_build * 1e3);
+  printf("%-6s %16s %16s\n", "node", "node 0 query/s", "local query/s");
+  int ret = 0;
+  for (size_t n = 0; n < nodes; ++n) {
+    double t_remote = 0., t_local = 0.;
+    size_t remote_hits = 0, local_hits = 0;
+    bool pinned = false;
+    std::thread worker([&]() {
+      pinned = bvh::run_on_numa_node(n);
+      std::vector<bvh::index_t> out;
+      auto start = std::chrono::steady_clock::now();
+      for (const auto &bb : boxes) {
+        out.clear();
+        replicated.replica(0).find_overlaps(bb, out);
+        remote_hits += out.size();
+      }
+      t_remote = elapsed(start);
+      start = std::chrono::steady_clock::now();
+      for (const auto &bb : boxes) {
+        out.clear();
+        replicated.find_overlaps(bb, out);
+        local_hits += out.size();
+      }
+      t_local = elapsed(start);
+    });
+    worker.join();
+    ret |= (remote_hits == local_hits) ? 0 : 1;
+    printf("%-6zu %16.0f %16.0f %s\n", n, double(queries) / t_remote,
+           double(queries) / t_local, pinned ? "" : "(not pinned)");
+  }
+  if (nodes == 1) {
+    printf("single node, so there is no remote memory to compare against\n");
+  }
+  return ret;
+}
+
+// queries against a static map too large to keep in memory, written to a
+// paged file and read through page caches of a few sizes, for a camera
+// sweeping across the map and for queries scattered over it
+static int bench_paged(int argc, char **args) {
+
+  const size_t count = (argc > 0) ? size_t(atoi(args[0])) : 1000000;
+  const size_t queries = (argc > 1) ? size_t(atoi(args[1])) : 20000;
+  const char *path = (argc > 2) ? args[2] : "bench_paged.bvh";
+  const float world = 65536.f;
+
+  std::vector<bvh::aabb_t> boxes(count);
+  for (auto &b : boxes) {
+    b = random_aabb(world, 16.f);
+  }
+  auto start = std::chrono::steady_clock::now();
+  if (!bvh::paged_bvh_t::write(path, boxes, 4096)) {
+    printf("failed to write %s\n", path);
+    return 1;
+  }
+  const double t_write = elapsed(start);
+
+  std::vector<bvh::aabb_t> sweep(queries), scatter(queries);
+  for (size_t q = 0; q < queries; ++q) {
+    // a 1024 wide view moving along rows of the map
+    const float t = float(q) / float(queries);
+    const float x = fmodf(t * 16.f, 1.f) * world;
+    const float y = (floorf(t * 16.f) + .5f) / 16.f * world;
+    sweep[q] = bvh::aabb_t{ x - 512.f, y - 512.f, x + 512.f, y + 512.f };
+    scatter[q] = random_aabb(world, 512.f);
+  }
+
+  bvh::paged_bvh_t paged;
+  int ret = 0;
+  std::vector<bvh::paged_index_t> out;
+  // check some queries against every box
+  if (paged.open(path, 64)) {
+    for (size_t q = 0; q < 100; ++q) {
+      out.clear();
+      paged.find_overlaps(scatter[q], out);
+      std::sort(out.begin(), out.end());
+      std::vector<bvh::paged_index_t> expect;
+      for (size_t i = 0; i < count; ++i) {
+        if (bvh::aabb_t::overlaps(scatter[q], boxes[i])) {
+          expect.push_back(bvh::paged_index_t(i));
+        }
+      }
+      ret |= (out == expect) ? 0 : 1;
+    }
+  }
+  else {
+    ret = 1;
+  }
+  printf("%zu leaves in %llu pages written in %.1f ms%s\n", count,
+         (unsigned long long)paged.pages(), t_write * 1e3,
+         ret ? " (results differ)" : "");
+  printf("%-8s %8s %10s %10s %10s %12s\n", "queries", "cache", "us/query",
+         "faults", "hit rate", "resident");
+  const size_t caches[] = { 16, 256, size_t(paged.pages()) };
+  for (int which = 0; which < 2; ++which) {
+    const auto &list = which ? scatter : sweep;
+    for (size_t cache : caches) {
+      paged.open(path, cache);
+      start = std::chrono::steady_clock::now();
+      for (const auto &bb : list) {
+        out.clear();
+        paged.find_overlaps(bb, out);
+      }
+      const double t = elapsed(start);
+      printf("%-8s %8zu %10.3f %10llu %10.3f %10zu kb\n",
+             which ? "scatter" : "sweep", cache, t * 1e6 / queries,
+             (unsigned long long)paged.stats().faults,
+             paged.stats().hit_rate(), paged.memory() / 1024);
+    }
+  }
+  paged.close();
+  remove(path);
+  return ret;
+}
+
+// drop a file from the page cache so it has to be read from disk again
+static void drop_cached(const char *path) {
+  const int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+// file positions of the leaves overlapping some queries, for comparing
+// trees built from the same file
+static std::vector<size_t> stream_results(bvh::bvh_t &tree,
+                                          const std::vector<bvh::index_t> &ids,
+                                          const std::vector<bvh::aabb_t> &qs) {
+  std::vector<size_t> position(tree.capacity(), 0);
+  for (size_t i = 0; i < ids.size(); ++i) {
+    position[ids[i]] = i;
+  }
+  std::vector<size_t> out;
+  std::vector<bvh::index_t> found;
+  for (const auto &q : qs) {
+    found.clear();
+    tree.find_overlaps(q, found);
+    std::vector<size_t> hits;
+    for (bvh::index_t i : found) {
+      hits.push_back(position[i]);
+    }
+    std::sort(hits.begin(), hits.end());
+    out.insert(out.end(), hits.begin(), hits.end());
+    out.push_back(~size_t(0));
+  }
+  return out;
+}
+
+// compare the time to the first query of reading a snapshot and then
+// building a tree from it against building while the file streams in
+static int bench_stream(int argc, char **args) {
+
+  const size_t chunk = (argc > 0) ? size_t(atoi(args[0])) : 1024;
+  const char *path = (argc > 1) ? args[1] : "bench_stream.bin";
+  const int runs = 8;
+
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  const size_t count = tree->capacity() / 2;
+  std::vector<bvh::aabb_t> boxes(count);
+  for (auto &b : boxes) {
+    b = random_aabb(4096.f, 16.f);
+  }
+  if (!bvh::write_boxes(path, boxes)) {
+    printf("failed to write %s\n", path);
+    return 1;
+  }
+  std::vector<bvh::aabb_t> queries(256);
+  for (auto &q : queries) {
+    q = random_aabb(4096.f, 64.f);
+  }
+
+  std::vector<bvh::index_t> ids;
+  std::vector<bvh::index_t> found;
+  std::vector<size_t> expect;
+  int ret = 0;
+  printf("%u boxes in chunks of %zu\n", unsigned(count), chunk);
+  printf("%-12s %10s %10s %10s %14s\n", "method", "first ms", "wait ms",
+         "build ms", "quality");
+  for (int method = 0; method < 3; ++method) {
+    double first = 0., wait = 0., build = 0.;
+    bool used_uring = false;
+    for (int run = 0; run < runs; ++run) {
+      tree->clear();
+      ids.clear();
+      drop_cached(path);
+      const auto start = std::chrono::steady_clock::now();
+      if (method == 0) {
+        // read the whole snapshot then build
+        std::vector<bvh::aabb_t> read;
+        const bool ok = bvh::read_boxes(path, read);
+        wait += elapsed(start);
+        const auto built = std::chrono::steady_clock::now();
+        tree->insert_batch(read, {}, ids);
+        build += elapsed(built);
+        ret |= ok ? 0 : 1;
+      }
+      else {
+        const bvh::io_mode_t mode =
+            (method == 1) ? bvh::io_mode_t::threads : bvh::io_mode_t::io_uring;
+        ret |= tree->load(path, chunk, ids, mode) ? 0 : 1;
+        wait += tree->load_stats().wait;
+        build += tree->load_stats().build;
+        used_uring = tree->load_stats().io_uring;
+      }
+      found.clear();
+      tree->find_overlaps(queries[0], found);
+      first += elapsed(start);
+    }
+    const std::vector<size_t> results = stream_results(*tree, ids, queries);
+    if (method == 0) {
+      expect = results;
+    }
+    else {
+      ret |= (results == expect) ? 0 : 1;
+    }
+    const char *name = (method == 0) ? "read+build"
+                       : (method == 1) ? "threads"
+                       : used_uring ? "io_uring" : "io_uring*";
+    printf("%-12s %10.3f %10.3f %10.3f %14.0f\n", name, first * 1e3 / runs,
+           wait * 1e3 / runs, build * 1e3 / runs, tree->quality());
+  }
+  if (ret) {
+    printf("results differ\n");
+  }
+  remove(path);
+  return ret;
+}
+
+// read a whole file, for comparing outputs
+static bool read_file(const char *path, std::vector<char> &out) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  out.resize(size_t(ftell(f)));
+  fseek(f, 0, SEEK_SET);
+  const bool ok = fread(out.data(), 1, out.size(), f) == out.size();
+  fclose(f);
+  return ok;
+}
+
+// compare writing a paged tree from boxes in memory against the external
+// builder working from a snapshot with a small memory budget
+static int bench_external(int argc, char **args) {
+
+  const size_t count = (argc > 0) ? size_t(atoi(args[0])) : 1000000;
+  const size_t memory = (argc > 1) ? size_t(atoi(args[1])) * 1024 : 1 << 20;
+  const char *boxes_path = "bench_external.bin";
+  const char *memory_path = "bench_external.mem";
+  const char *external_path = "bench_external.ext";
+
+  std::vector<bvh::aabb_t> boxes(count);
+  for (auto &b : boxes) {
+    b = random_aabb(65536.f, 16.f);
+  }
+  if (!bvh::write_boxes(boxes_path, boxes)) {
+    printf("failed to write %s\n", boxes_path);
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  const bool ok_memory = bvh::paged_bvh_t::write(memory_path, boxes, 4096);
+  const double t_memory = elapsed(start);
+  // the boxes plus their sorted copy with codes and indices
+  const size_t held = count * (2 * sizeof(bvh::aabb_t) + 8);
+  boxes = std::vector<bvh::aabb_t>();
+
+  start = std::chrono::steady_clock::now();
+  const bool ok_external =
+      bvh::paged_bvh_t::write_external(boxes_path, external_path, 4096,
+                                       memory);
+  const double t_external = elapsed(start);
+
+  std::vector<char> a, b;
+  const bool same = ok_memory && ok_external && read_file(memory_path, a) &&
+                    read_file(external_path, b) && a == b;
+  printf("%zu boxes, %zu kb of output\n", count, a.size() / 1024);
+  printf("%-10s %10s %12s\n", "builder", "ms", "budget");
+  printf("%-10s %10.1f %9zu kb\n", "memory", t_memory * 1e3, held / 1024);
+  printf("%-10s %10.1f %9zu kb\n", "external", t_external * 1e3,
+         memory / 1024);
+  printf("output %s\n", same ? "identical" : "differs");
+  remove(boxes_path);
+  remove(memory_path);
+  remove(external_path);
+  return same ? 0 : 1;
+}
+
+// what the reader process of the shared bench saw
+struct shared_report_t {
+  uint64_t queries;
+  uint64_t retries;
+  uint64_t versions;
+  double seconds;
+};
+
+// query a shared tree from another process until the writer is done
+static shared_report_t shared_reader(const char *name, uint64_t last) {
+  shared_report_t r = {};
+  bvh::shared_view_t view;
+  if (!view.open(name)) {
+    return r;
+  }
+  std::vector<bvh::index_t> found;
+  uint64_t seen = 0;
+  const auto start = std::chrono::steady_clock::now();
+  // give up if the writer goes away
+  while (seen < last && elapsed(start) < 30.) {
+    found.clear();
+    const uint64_t version =
+        view.find_overlaps(random_aabb(4096.f, 64.f), found);
+    r.versions += (version != seen) ? 1 : 0;
+    seen = version;
+    ++r.queries;
+  }
+  r.retries = view.retries();
+  r.seconds = elapsed(start);
+  return r;
+}
+
+// publish a moving world to shared memory each frame while another process
+// queries it, checking the published versions against the tree
+static int bench_shared(int argc, char **args) {
+
+  const size_t frames = (argc > 0) ? size_t(atoi(args[0])) : 200;
+  const char *name = "/bvh_bench_shared";
+  const float world = 4096.f;
+
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  bvh::shared_bvh_t shared;
+  if (!shared.create(name)) {
+    printf("failed to create %s\n", name);
+    return 1;
+  }
+  std::vector<mover_t> movers(tree->capacity() / 2);
+  std::vector<bvh::index_t> handles(movers.size());
+  for (size_t i = 0; i < movers.size(); ++i) {
+    movers[i].make(world, 1.f);
+    handles[i] = tree->insert(movers[i].aabb(), nullptr);
+  }
+  shared.publish(*tree);
+
+  int channel[2];
+  if (pipe(channel) != 0) {
+    return 1;
+  }
+  const pid_t child = fork();
+  if (child == 0) {
+    close(channel[0]);
+    const shared_report_t r = shared_reader(name, frames + 1);
+    const bool ok = write(channel[1], &r, sizeof(r)) == ssize_t(sizeof(r));
+    _exit(ok ? 0 : 1);
+  }
+  close(channel[1]);
+
+  bvh::shared_view_t view;
+  int ret = view.open(name) ? 0 : 1;
+  std::vector<bvh::index_t> a, b;
+  double t_publish = 0.;
+  uint64_t copied = 0;
+  for (size_t f = 0; f < frames && !ret; ++f) {
+    // a tenth of the world moves each frame
+    for (size_t i = f % 10; i < movers.size(); i += 10) {
+      movers[i].tick(world);
+      tree->move(handles[i], movers[i].aabb());
+    }
+    const auto start = std::chrono::steady_clock::now();
+    const uint64_t version = shared.publish(*tree);
+    t_publish += elapsed(start);
+    copied += shared.copied();
+    for (size_t q = 0; q < 16; ++q) {
+      const bvh::aabb_t bb = random_aabb(world, 64.f);
+      a.clear();
+      b.clear();
+      tree->find_overlaps(bb, a);
+      ret |= (view.find_overlaps(bb, b) == version && a == b) ? 0 : 1;
+    }
+  }
+
+  shared_report_t r = {};
+  const bool got = read(channel[0], &r, sizeof(r)) == ssize_t(sizeof(r));
+  close(channel[0]);
+  int status = 0;
+  waitpid(child, &status, 0);
+  ret |= got ? 0 : 1;
+
+  printf("%zu leaves, %zu nodes, %zu frames\n", movers.size(), tree->size(),
+         frames);
+  printf("publish     %8.3f ms   %8.0f nodes copied per frame\n",
+         t_publish * 1e3 / frames, double(copied) / frames);
+  printf("reader      %8.0f queries/s   %llu retries   %llu versions seen\n",
+         r.seconds > 0. ? r.queries / r.seconds : 0.,
+         (unsigned long long)r.retries, (unsigned long long)r.versions);
+  printf("published versions %s\n", ret ? "differ" : "match the tree");
+  shared.close();
+  return ret;
+}
+
+// count the nodes an overlap query visits when culling interior nodes on
+// their fat aabbs, as queries did before interior nodes had tight bounds
+static uint64_t fat_query(const bvh::bvh_t &tree, const bvh::aabb_t &bb,
+                          std::vector<bvh::index_t> &out) {
+  uint64_t visits = 0;
+  std::vector<bvh::index_t> stack;
+  if (!tree.empty()) {
+    stack.push_back(tree.root_index());
+  }
+  while (!stack.empty()) {
+    const bvh::node_t &n = tree.get(stack.back());
+    const bvh::index_t i = stack.back();
+    stack.pop_back();
+    ++visits;
+    if (n.count == 0 || !bvh::aabb_t::overlaps(bb, n.aabb)) {
+      continue;
+    }
+    if (n.is_leaf()) {
+      if (bvh::aabb_t::overlaps(bb, n.tight)) {
+        out.push_back(i);
+      }
+    }
+    else {
+      stack.push_back(n.child[0]);
+      stack.push_back(n.child[1]);
+    }
+  }
+  return visits;
+}
+
+// node visits for queries culled on fat and on tight interior bounds while
+// movers wander inside their fat aabbs
+static int bench_tight(int argc, char **args) {
+
+  const size_t count = 8192;
+  const size_t frames = (argc > 0) ? size_t(atoi(args[0])) : 100;
+  const float growth = (argc > 1) ? float(atof(args[1])) : 16.f;
+  const size_t queries = 256;
+
+  std::vector<mover_t> movers(count);
+  for (auto &m : movers) {
+    m.make(4096.f, 1.f);
+  }
+  std::unique_ptr<bvh::bvh_t> tree(new bvh::bvh_t);
+  tree->growth = growth;
+  std::vector<bvh::index_t> handles(count);
+  for (size_t i = 0; i < count; ++i) {
+    handles[i] = tree->insert(movers[i].aabb(), &movers[i]);
+  }
+
+  uint64_t fat_nodes = 0, tight_nodes = 0;
+  double fat_time = 0., tight_time = 0.;
+  int ret = 0;
+  std::vector<bvh::index_t> a, b;
+  for (size_t f = 0; f < frames; ++f) {
+    for (size_t i = 0; i < count; ++i) {
+      movers[i].tick(4096.f);
+      tree->move(handles[i], movers[i].aabb());
+    }
+    tree->end_frame();
+    for (size_t q = 0; q < queries; ++q) {
+      const bvh::aabb_t bb = random_aabb(4096.f, 64.f);
+      a.clear();
+      b.clear();
+      auto start = std::chrono::steady_clock::now();
+      fat_nodes += fat_query(*tree, bb, a);
+      fat_time += elapsed(start);
+
+      start = std::chrono::steady_clock::now();
+      tree->find_overlaps(bb, b);
+      tight_time += elapsed(start);
+
+      std::sort(a.begin(), a.end());
+      std::sort(b.begin(), b.end());
+      ret |= (a == b) ? 0 : 1;
+    }
+    tight_nodes += tree->frame_stats().query_nodes;
+  }
+  const double n = double(frames * queries);
+  printf("%-6s %10.1f nodes/query %10.3f us/query\n", "fat",
+         double(fat_nodes) / n, fat_time * 1e6 / n);
+  printf("%-6s %10.1f nodes/query %10.3f us/query %s\n", "tight",
+         double(tight_nodes) / n, tight_time * 1e6 / n,
+         ret ? "(results differ)" : "");
+  return ret;
+}
+
+struct bench_t {
+  const char *name;
+  int (*run)(int argc, char **args);
+};
+
+static const bench_t benches[] = {
+  { "memory", bench_memory },
+  { "batch", bench_batch },
+  { "despawn", bench_despawn },
+  { "maintain", bench_maintain },
+  { "churn", bench_churn },
+  { "growth", bench_growth },
+  { "delta", bench_delta },
+  { "raster", bench_raster },
+  { "parallel", bench_parallel },
+  { "islands", bench_islands },
+  { "sleep", bench_sleep },
+  { "rays", bench_rays },
+  { "sector", bench_sector },
+  { "nearest", bench_nearest },
+  { "topk", bench_topk },
+  { "sample", bench_sample },
+  { "packed", bench_packed },
+  { "numa", bench_numa },
+  { "paged", bench_paged },
+  { "stream", bench_stream },
+  { "external", bench_external },
+  { "shared", bench_shared },
+  { "tight", bench_tight },
+};
+
+int main(int argc, char **args) {
+
+  const char *name = (argc > 1) ? args[1] : nullptr;
+
+  for (const bench_t &mode : benches) {
+    if (!name || strcmp(name, mode.name) == 0) {
+      const int ret = mode.run(name ? argc - 2 : 0, args + 2);
+      if (ret || name) {
+        return ret;
+      }
+    }
+  }
+  if (name) {
+    fprintf(stderr, "unknown mode '%s', available modes:\n", name);
+    for (const bench_t &mode : benches) {
+      fprintf(stderr, "  %s\n", mode.name);
+    }
+    return 1;
+  }
+  return 0;
+}
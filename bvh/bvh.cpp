@@ -1,9 +1,41 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iterator>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define BVH_SSE 1
+#endif
+
+#if BVH_NUMA
+#include <numa.h>
+#include <sched.h>
+#endif
+
+#if BVH_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 #include "bvh.h"
 
 // enable to validate the tree after every operation
+#ifndef VALIDATE
 #define VALIDATE 1
+#endif
 
 namespace {
 // fixed size binary heap implementation
@@ -130,530 +162,4448 @@ protected:
   }
 };
 
-// line segment aabb intersection test
-bool raycast(float ax, float ay, float bx, float by, const bvh::aabb_t &aabb) {
-  static const float EPSILON = 0.0001f;
-  const float dx = (bx - ax) * .5f;
-  const float dy = (by - ay) * .5f;
-  const float ex = (aabb.maxx - aabb.minx) * .5f;
-  const float ey = (aabb.maxy - aabb.miny) * .5f;
-  const float cx = ax + dx - (aabb.minx + aabb.maxx) * .5f;
-  const float cy = ay + dy - (aabb.miny + aabb.maxy) * .5f;
-  const float adx = fabsf(dx);
-  const float ady = fabsf(dy);
-  if (fabsf(cx) > (ex + adx)) return false;
-  if (fabsf(cy) > (ey + ady)) return false;
-  return (fabsf(dx * cy - dy * cx) <= (ex * ady + ey * adx + EPSILON));
-}
+// slack allowed when projecting an aabb onto a segment normal, so that a
+// segment grazing an edge or corner still hits. the normal is as long as the
+// segment, so this is a tolerance of 1e-4 measured against half of it.
+static const float c_ray_epsilon = 2.f * .0001f;
 
-}  // namespace {}
+// a line segment prepared for testing against many aabbs
+struct segment_t {
 
-namespace bvh {
+  segment_t(float ax, float ay, float bx, float by)
+    : ax(ax)
+    , ay(ay)
+    , nx(ay - by)
+    , ny(bx - ax)
+    , minx(std::min(ax, bx))
+    , miny(std::min(ay, by))
+    , maxx(std::max(ax, bx))
+    , maxy(std::max(ay, by))
+  {}
 
-bool aabb_t::raycast(float x0, float y0, float x1, float y1) const {
-  return ::raycast(x0, y0, x1, y1, *this);
-}
+  // separating axis test of the segment against an aabb. each step only
+  // grows with the aabb, so a node passes whenever a box inside it does
+  // despite rounding, which culling on exact unions relies on. the slack is
+  // the same for every aabb so it keeps that property.
+  bool hits(const bvh::aabb_t &aabb) const {
+    if (aabb.maxx < minx || aabb.minx > maxx) return false;
+    if (aabb.maxy < miny || aabb.miny > maxy) return false;
+    // project the aabb onto the segment normal, relative to its start
+    const float x0 = nx * (aabb.minx - ax), x1 = nx * (aabb.maxx - ax);
+    const float y0 = ny * (aabb.miny - ay), y1 = ny * (aabb.maxy - ay);
+    return (std::min(x0, x1) + std::min(y0, y1) <= c_ray_epsilon) &&
+           (std::max(x0, x1) + std::max(y0, y1) >= -c_ray_epsilon);
+  }
 
-bvh_t::bvh_t()
-  : growth(16.f)
-  , _free_list(invalid_index)
-  , _root(invalid_index)
-{
-  clear();
-}
+  // start of the segment
+  float ax, ay;
+  // normal of the segment, as long as it is
+  float nx, ny;
+  // bounds of the segment
+  float minx, miny;
+  float maxx, maxy;
+};
 
-void bvh_t::clear() {
-  _free_all();
-  _root = invalid_index;
+// line segment aabb intersection test
+bool raycast(float ax, float ay, float bx, float by, const bvh::aabb_t &aabb) {
+  return segment_t(ax, ay, bx, by).hits(aabb);
 }
 
-bool bvh_t::_is_leaf(index_t index) const {
-  return get(index).is_leaf();
-}
+// number of rays traced together by raycast_batch(), one per bit of a mask
+static const uint32_t c_ray_packet = 32;
 
-// return a quality metric for this subtree
-float bvh_t::_quality(index_t n) const {
-  if (n == invalid_index) {
-    return 0.f;
+// a packet of segments stored by component so several can be tested at once
+struct packet_t {
+
+  void set(uint32_t j, const segment_t &s) {
+    ax[j] = s.ax;
+    ay[j] = s.ay;
+    nx[j] = s.nx;
+    ny[j] = s.ny;
+    minx[j] = s.minx;
+    miny[j] = s.miny;
+    maxx[j] = s.maxx;
+    maxy[j] = s.maxy;
   }
-  const node_t &node = _get(n);
-  if (node.is_leaf()) {
-    return 0.f;
+
+  // return which of the segments in 'mask' hit an aabb, giving exactly the
+  // same answer as segment_t::hits()
+  uint32_t hits(const bvh::aabb_t &aabb, uint32_t mask) const {
+    uint32_t out = 0;
+#if BVH_SSE
+    const __m128 bminx = _mm_set1_ps(aabb.minx);
+    const __m128 bminy = _mm_set1_ps(aabb.miny);
+    const __m128 bmaxx = _mm_set1_ps(aabb.maxx);
+    const __m128 bmaxy = _mm_set1_ps(aabb.maxy);
+    const __m128 slack = _mm_set1_ps(c_ray_epsilon);
+    const __m128 neg_slack = _mm_set1_ps(-c_ray_epsilon);
+    for (uint32_t g = 0; g < c_ray_packet; g += 4) {
+      const uint32_t lanes = (mask >> g) & 0xf;
+      if (!lanes) {
+        continue;
+      }
+      const __m128 t0 = _mm_and_ps(
+        _mm_and_ps(_mm_cmpge_ps(bmaxx, _mm_load_ps(minx + g)),
+                   _mm_cmple_ps(bminx, _mm_load_ps(maxx + g))),
+        _mm_and_ps(_mm_cmpge_ps(bmaxy, _mm_load_ps(miny + g)),
+                   _mm_cmple_ps(bminy, _mm_load_ps(maxy + g))));
+      const __m128 vax = _mm_load_ps(ax + g);
+      const __m128 vay = _mm_load_ps(ay + g);
+      const __m128 vnx = _mm_load_ps(nx + g);
+      const __m128 vny = _mm_load_ps(ny + g);
+      const __m128 x0 = _mm_mul_ps(vnx, _mm_sub_ps(bminx, vax));
+      const __m128 x1 = _mm_mul_ps(vnx, _mm_sub_ps(bmaxx, vax));
+      const __m128 y0 = _mm_mul_ps(vny, _mm_sub_ps(bminy, vay));
+      const __m128 y1 = _mm_mul_ps(vny, _mm_sub_ps(bmaxy, vay));
+      const __m128 lo = _mm_add_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1));
+      const __m128 hi = _mm_add_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1));
+      const __m128 t1 = _mm_and_ps(_mm_cmple_ps(lo, slack),
+                                   _mm_cmpge_ps(hi, neg_slack));
+      const int bits = _mm_movemask_ps(_mm_and_ps(t0, t1));
+      out |= (uint32_t(bits) & lanes) << g;
+    }
+#else
+    for (uint32_t j = 0; j < c_ray_packet; ++j) {
+      if (!(mask & (1u << j))) {
+        continue;
+      }
+      if (aabb.maxx < minx[j] || aabb.minx > maxx[j]) continue;
+      if (aabb.maxy < miny[j] || aabb.miny > maxy[j]) continue;
+      const float x0 = nx[j] * (aabb.minx - ax[j]);
+      const float x1 = nx[j] * (aabb.maxx - ax[j]);
+      const float y0 = ny[j] * (aabb.miny - ay[j]);
+      const float y1 = ny[j] * (aabb.maxy - ay[j]);
+      if ((std::min(x0, x1) + std::min(y0, y1) <= c_ray_epsilon) &&
+          (std::max(x0, x1) + std::max(y0, y1) >= -c_ray_epsilon)) {
+        out |= 1u << j;
+      }
+    }
+#endif
+    return out;
   }
-  // cost metric is the sum of the surface area of all interior nodes (non root or leaf)
-  return ((n == _root) ? 0.f : node.aabb.area()) +
-    _quality(node.child[0]) +
-    _quality(node.child[1]);
-}
 
-index_t bvh_t::_insert_into_leaf(index_t leaf, index_t node) {
-  assert(_is_leaf(leaf));
-  // create new internal node
-  index_t inter = _new_node();
-  // insert children
-  _get(inter).child[0] = leaf;
-  _get(inter).child[1] = node;
-  // keep track of the parents
-  _get(inter).parent = invalid_index;  // fixed up by callee
-  _get(leaf).parent = inter;
-  _get(node).parent = inter;
-  // recalculate the aabb on way up
-  _get(inter).aabb = aabb_t::find_union(_get(leaf).aabb, _get(node).aabb);
-  // new child is the intermediate node
-  return inter;
-}
+  alignas(16) float ax[c_ray_packet], ay[c_ray_packet];
+  alignas(16) float nx[c_ray_packet], ny[c_ray_packet];
+  alignas(16) float minx[c_ray_packet], miny[c_ray_packet];
+  alignas(16) float maxx[c_ray_packet], maxy[c_ray_packet];
+};
 
-index_t bvh_t::insert(const aabb_t &aabb, void *user_data) {
-  // create the new node
-  index_t index = _new_node();
-  assert(index != invalid_index);
-  auto &node = _get(index);
-  // grow the aabb by a factor
-  node.aabb = aabb_t::grow(aabb, growth);
-  // 
-  node.user_data = user_data;
-  node.parent = invalid_index;
-  // mark that this is a leaf
-  node.child[0] = invalid_index;
-  node.child[1] = invalid_index;
-  // insert into the tree
-  if (_root == invalid_index) {
-    _root = index;
-    return index;
+// pi and half of it
+static const float c_pi = 3.14159265f;
+static const float c_half_pi = 1.57079633f;
+
+// a circular sector prepared for testing against many aabbs. the wedge is
+// bounded by two half planes through the apex, and is their intersection
+// when it is no wider than a half plane and their union otherwise.
+struct wedge_t {
+
+  wedge_t() = default;
+
+  explicit wedge_t(const bvh::sector_t &s)
+    : x(s.x)
+    , y(s.y)
+    , r2(s.radius * s.radius)
+  {
+    assert(s.radius >= 0.f);
+    const float len = sqrtf(s.dx * s.dx + s.dy * s.dy);
+    const float ax = (len > 0.f) ? s.dx / len : 1.f;
+    const float ay = (len > 0.f) ? s.dy / len : 0.f;
+    const float h = std::min(std::max(s.half_angle, 0.f), c_pi);
+    const float c = cosf(h);
+    const float sn = sinf(h);
+    // the edges are the axis turned either way by the half angle, with
+    // normals pointing out of the wedge
+    nx[0] = -(ax * sn + ay * c);
+    ny[0] = ax * c - ay * sn;
+    nx[1] = ay * c - ax * sn;
+    ny[1] = -(ax * c + ay * sn);
+    convex = h <= c_half_pi;
   }
-  if (_is_leaf(_root)) {
-    _root = _insert_into_leaf(_root, index);
-    _validate(_root);
-    return index;
+
+  // conservative test which never rejects an aabb the sector overlaps. an
+  // aabb inside one which is rejected is always rejected too.
+  bool maybe(const bvh::aabb_t &b) const {
+    // closest point of the aabb to the apex
+    const float qx = std::min(std::max(x, b.minx), b.maxx) - x;
+    const float qy = std::min(std::max(y, b.miny), b.maxy) - y;
+    if (qx * qx + qy * qy > r2) {
+      return false;
+    }
+    // check if some of the aabb lies inside each half plane
+    const float x0 = b.minx - x, x1 = b.maxx - x;
+    const float y0 = b.miny - y, y1 = b.maxy - y;
+    bool in[2];
+    for (int k = 0; k < 2; ++k) {
+      in[k] = std::min(nx[k] * x0, nx[k] * x1) +
+              std::min(ny[k] * y0, ny[k] * y1) <= 0.f;
+    }
+    return convex ? (in[0] && in[1]) : (in[0] || in[1]);
   }
-  _insert(index);
-#if VALIDATE
-  _validate(_root);
-#endif
-  // return this index
-  return index;
-}
 
-void bvh_t::_recalc_aabbs(index_t i) {
-  // walk from leaf to root recalculating aabbs
-  while (i != invalid_index) {
-    node_t &y = _get(i);
-    y.aabb = aabb_t::find_union(_get(y.child[0]).aabb, _get(y.child[1]).aabb);
-    _optimize(y);
-    i = y.parent;
+  // exact test of the sector against an aabb
+  bool hits(const bvh::aabb_t &b) const {
+    if (!maybe(b)) {
+      return false;
+    }
+    if (x >= b.minx && x <= b.maxx && y >= b.miny && y <= b.maxy) {
+      return true;
+    }
+    // most often a corner lies inside the sector
+    const float px[4] = { b.minx - x, b.maxx - x, b.maxx - x, b.minx - x };
+    const float py[4] = { b.miny - y, b.miny - y, b.maxy - y, b.maxy - y };
+    for (int i = 0; i < 4; ++i) {
+      if (px[i] * px[i] + py[i] * py[i] > r2) {
+        continue;
+      }
+      const bool in0 = nx[0] * px[i] + ny[0] * py[i] <= 0.f;
+      const bool in1 = nx[1] * px[i] + ny[1] * py[i] <= 0.f;
+      if (convex ? (in0 && in1) : (in0 || in1)) {
+        return true;
+      }
+    }
+    if (convex) {
+      return _reaches(b, 0, 2);
+    }
+    return _reaches(b, 0, 1) || _reaches(b, 1, 2);
   }
-}
 
-index_t bvh_t::_find_best_sibling(const aabb_t &aabb) const {
+  // apex
+  float x, y;
+  // squared radius
+  float r2;
+  // outward normals of the edges
+  float nx[2], ny[2];
+  // set if the wedge is the intersection of its half planes
+  bool convex;
 
-  struct search_t {
-    index_t index;
-    float cost;
+protected:
 
-    bool operator < (const search_t &rhs) const {
-      return cost < rhs.cost;
+  // clip the aabb to the half planes [k0, k1) and check if what remains is
+  // within the radius, given that the apex lies outside the aabb
+  bool _reaches(const bvh::aabb_t &b, int k0, int k1) const {
+    // corners relative to the apex, with room for one more per plane
+    float px[8] = { b.minx - x, b.maxx - x, b.maxx - x, b.minx - x };
+    float py[8] = { b.miny - y, b.miny - y, b.maxy - y, b.maxy - y };
+    int n = 4;
+    for (int k = k0; k < k1; ++k) {
+      float ox[8], oy[8];
+      int m = 0;
+      for (int i = 0; i < n; ++i) {
+        const int j = (i + 1) % n;
+        const float di = nx[k] * px[i] + ny[k] * py[i];
+        const float dj = nx[k] * px[j] + ny[k] * py[j];
+        if (di <= 0.f) {
+          ox[m] = px[i];
+          oy[m++] = py[i];
+        }
+        if ((di <= 0.f) != (dj <= 0.f)) {
+          const float t = di / (di - dj);
+          ox[m] = px[i] + (px[j] - px[i]) * t;
+          oy[m++] = py[i] + (py[j] - py[i]) * t;
+        }
+      }
+      if (m == 0) {
+        return false;
+      }
+      std::copy(ox, ox + m, px);
+      std::copy(oy, oy + m, py);
+      n = m;
     }
-  };
-  // XXX: warning, fixed size here
-  bin_heap_t<search_t, 1024> pqueue;
-
-  if (_root != invalid_index) {
-    pqueue.push(search_t{ _root, 0.f });
+    // the apex is outside so its distance is that of the nearest edge
+    for (int i = 0; i < n; ++i) {
+      const int j = (i + 1) % n;
+      const float ex = px[j] - px[i];
+      const float ey = py[j] - py[i];
+      const float ee = ex * ex + ey * ey;
+      const float t = (ee > 0.f) ?
+        std::min(std::max(-(px[i] * ex + py[i] * ey) / ee, 0.f), 1.f) : 0.f;
+      const float cx = px[i] + ex * t;
+      const float cy = py[i] + ey * t;
+      if (cx * cx + cy * cy <= r2) {
+        return true;
+      }
+    }
+    return false;
   }
+};
 
-  float best_cost = INFINITY;
-  index_t best_index = invalid_index;
+// number of sectors traced together by find_in_sector_batch()
+static const uint32_t c_sector_packet = 32;
 
-  while (!pqueue.empty()) {
-    // pop one node (lowest cost so far)
-    const search_t s = pqueue.pop();
-    const node_t &n = _get(s.index);
-    // find the cost for inserting into this node
-    const aabb_t uni = aabb_t::find_union(aabb, n.aabb);
-    const float growth = uni.area() - n.aabb.area();
-    assert(growth >= 0.f);
-    const float cost = s.cost + growth;
-    // skip the entire subtree if we know we have a better choice
-    if (cost >= best_cost) {
-      continue;
-    }
-    if (n.is_leaf()) {
-      best_cost = cost;
-      best_index = s.index;
+// a packet of sectors stored by component so several can be culled at once
+struct wedge_packet_t {
+
+  void set(uint32_t j, const wedge_t &w) {
+    x[j] = w.x;
+    y[j] = w.y;
+    r2[j] = w.r2;
+    nx0[j] = w.nx[0];
+    ny0[j] = w.ny[0];
+    nx1[j] = w.nx[1];
+    ny1[j] = w.ny[1];
+    convex[j] = w.convex ? 1.f : 0.f;
+  }
+
+  // return which of the sectors in 'mask' might overlap an aabb, giving
+  // exactly the same answer as wedge_t::maybe()
+  uint32_t maybe(const bvh::aabb_t &b, uint32_t mask) const {
+    uint32_t out = 0;
+#if BVH_SSE
+    const __m128 minx = _mm_set1_ps(b.minx);
+    const __m128 miny = _mm_set1_ps(b.miny);
+    const __m128 maxx = _mm_set1_ps(b.maxx);
+    const __m128 maxy = _mm_set1_ps(b.maxy);
+    const __m128 zero = _mm_setzero_ps();
+    for (uint32_t g = 0; g < c_sector_packet; g += 4) {
+      const uint32_t lanes = (mask >> g) & 0xf;
+      if (!lanes) {
+        continue;
+      }
+      const __m128 vx = _mm_load_ps(x + g);
+      const __m128 vy = _mm_load_ps(y + g);
+      const __m128 qx = _mm_sub_ps(_mm_min_ps(_mm_max_ps(vx, minx), maxx), vx);
+      const __m128 qy = _mm_sub_ps(_mm_min_ps(_mm_max_ps(vy, miny), maxy), vy);
+      const __m128 near = _mm_cmple_ps(
+        _mm_add_ps(_mm_mul_ps(qx, qx), _mm_mul_ps(qy, qy)),
+        _mm_load_ps(r2 + g));
+      const __m128 x0 = _mm_sub_ps(minx, vx), x1 = _mm_sub_ps(maxx, vx);
+      const __m128 y0 = _mm_sub_ps(miny, vy), y1 = _mm_sub_ps(maxy, vy);
+      const __m128 n0x = _mm_load_ps(nx0 + g), n0y = _mm_load_ps(ny0 + g);
+      const __m128 n1x = _mm_load_ps(nx1 + g), n1y = _mm_load_ps(ny1 + g);
+      const __m128 in0 = _mm_cmple_ps(_mm_add_ps(
+        _mm_min_ps(_mm_mul_ps(n0x, x0), _mm_mul_ps(n0x, x1)),
+        _mm_min_ps(_mm_mul_ps(n0y, y0), _mm_mul_ps(n0y, y1))), zero);
+      const __m128 in1 = _mm_cmple_ps(_mm_add_ps(
+        _mm_min_ps(_mm_mul_ps(n1x, x0), _mm_mul_ps(n1x, x1)),
+        _mm_min_ps(_mm_mul_ps(n1y, y0), _mm_mul_ps(n1y, y1))), zero);
+      const __m128 cvx = _mm_cmpgt_ps(_mm_load_ps(convex + g), zero);
+      const __m128 in = _mm_or_ps(_mm_and_ps(cvx, _mm_and_ps(in0, in1)),
+                                  _mm_andnot_ps(cvx, _mm_or_ps(in0, in1)));
+      const int bits = _mm_movemask_ps(_mm_and_ps(near, in));
+      out |= (uint32_t(bits) & lanes) << g;
     }
-    else {
-      assert(n.child[0] != invalid_index);
-      assert(n.child[1] != invalid_index);
-      pqueue.push(search_t{ n.child[0], cost });
-      pqueue.push(search_t{ n.child[1], cost });
+#else
+    for (uint32_t j = 0; j < c_sector_packet; ++j) {
+      if (!(mask & (1u << j))) {
+        continue;
+      }
+      const float qx = std::min(std::max(x[j], b.minx), b.maxx) - x[j];
+      const float qy = std::min(std::max(y[j], b.miny), b.maxy) - y[j];
+      if (qx * qx + qy * qy > r2[j]) {
+        continue;
+      }
+      const float x0 = b.minx - x[j], x1 = b.maxx - x[j];
+      const float y0 = b.miny - y[j], y1 = b.maxy - y[j];
+      const bool in0 = std::min(nx0[j] * x0, nx0[j] * x1) +
+                       std::min(ny0[j] * y0, ny0[j] * y1) <= 0.f;
+      const bool in1 = std::min(nx1[j] * x0, nx1[j] * x1) +
+                       std::min(ny1[j] * y0, ny1[j] * y1) <= 0.f;
+      if ((convex[j] > 0.f) ? (in0 && in1) : (in0 || in1)) {
+        out |= 1u << j;
+      }
     }
+#endif
+    return out;
   }
-  // return the best leaf we cound find
-  return best_index;
-}
 
-void bvh_t::_insert(index_t node) {
+  alignas(16) float x[c_sector_packet], y[c_sector_packet];
+  alignas(16) float r2[c_sector_packet];
+  alignas(16) float nx0[c_sector_packet], ny0[c_sector_packet];
+  alignas(16) float nx1[c_sector_packet], ny1[c_sector_packet];
+  alignas(16) float convex[c_sector_packet];
+};
 
-  // note: this insert phase assumes that there are at least two nodes already
-  //       in the tree and thus _root is a non leaf node.
+// candidate node when searching for the best insertion sibling
+struct search_t {
+  bvh::index_t index;
+  float cost;
 
-  // find the best sibling for node
-  const aabb_t &aabb = _get(node).aabb;
-  index_t sibi = _find_best_sibling(aabb);
-  assert(sibi != invalid_index);
-  // once the best leaf has been found we come to the insertion phase
-  const node_t &sib = _get(sibi);
-  assert(sib.is_leaf());
-  const index_t parent = sib.parent;
-  const index_t inter = _insert_into_leaf(sibi, node);
-  _get(inter).parent = parent;
-  // fix up parent child relationship
-  if (parent != invalid_index) {
-    node_t &p = _get(parent);
-    p.replace_child(sibi, inter);
+  bool operator < (const search_t &rhs) const {
+    return cost < rhs.cost;
   }
-  // recalculate aabb and optimize on the way up
-  _recalc_aabbs(parent);
-}
+};
 
-void bvh_t::remove(index_t index) {
-  assert(index != invalid_index);
-  assert(_is_leaf(index));
-  auto &node = _get(index);
-  _unlink(index);
-  node.child[0] = _free_list;
-  node.child[1] = invalid_index;
-  _free_list = index;
-#if VALIDATE
-  _validate(_root);
-#endif
+// XXX: warning, fixed size here
+typedef bin_heap_t<search_t, 1024> sibling_heap_t;
+
+// initial capacity of the traversal stack used by queries
+static const size_t c_stack_reserve = 128;
+
+// a batch group is grafted as one subtree when the summed area of the tight
+// boxes of its leaves covers at least this fraction of their bounding box
+static const float c_graft_density = .5f;
+
+// a batch removal of at least this fraction of the leaves will rebuild the
+// tree from the survivors instead of collapsing it
+static const float c_rebuild_fraction = .5f;
+
+// node marks used when removing a batch of leaves
+enum : uint8_t {
+  mark_keep,     // untouched by the removal
+  mark_dead,     // a leaf being removed
+  mark_touched,  // an ancestor of a leaf being removed
+};
+
+// number of frames of stats kept for auditing maintenance decisions
+static const size_t c_max_history = 256;
+
+// number of frames over which a rebuild is expected to pay for itself
+static const float c_rebuild_horizon = 16.f;
+
+// smoothing applied to the maintenance cost model
+static const float c_policy_smoothing = .1f;
+
+// number of bins used by the binned sah builder
+static const int c_sah_bins = 16;
+
+// subtrees with fewer leaves than this are not worth rebuilding
+static const size_t c_min_rebuild_leaves = 32;
+
+// largest subtree checked for degradation, which bounds the cost of the
+// check to a constant number of binned builds per leaf
+static const size_t c_max_rebuild_leaves = 2048;
+
+// frames to wait after a search for degraded subtrees found none
+static const uint32_t c_partial_cooldown = 8;
+
+// fraction of the growth added around a moved leaf when the tight bounds of
+// its ancestors have to grow to cover it
+static const float c_tight_slack = .25f;
+
+// frames gathered into each sample taken by the growth tuner
+static const uint32_t c_growth_frames = 8;
+
+// largest relative change the growth tuner makes to the growth per sample
+static const float c_growth_max_step = .25f;
+
+// limits on the growth chosen by the tuner
+static const float c_growth_min = .25f;
+static const float c_growth_max = 1024.f;
+
+// depth to which the tree is split into tasks by find_pairs(). the tasks
+// depend only on the tree and not on the number of threads.
+static const uint32_t c_pair_task_depth = 6;
+
+// bits of direction in the sort key used by raycast_batch()
+static const uint32_t c_ray_dir_bits = 4;
+
+// one over two pi
+static const float c_inv_tau = 0.159154943f;
+
+// resolve a requested thread count, where zero means one per core
+uint32_t thread_count(uint32_t threads) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  return threads;
 }
 
-void bvh_t::move(index_t index, const aabb_t &aabb) {
-  assert(index != invalid_index);
-  assert(_is_leaf(index));
-  auto &node = _get(index);
-  // check fat aabb against slim new aabb for hysteresis on our updates
-  if (node.aabb.contains(aabb)) {
-    // this is okay and we can early exit
+// run task(thread, i) for every i in [0, count) across a number of threads.
+// tasks are handed out in order to whichever thread is free, so a tasks
+// output must not depend on the thread running it.
+template <typename task_t>
+void parallel_for(size_t count, uint32_t threads, task_t &&task) {
+  threads = uint32_t(std::min<size_t>(threads, count));
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; ++i) {
+      task(0u, i);
+    }
     return;
   }
-  // effectively remove this node from the tree
-  _unlink(index);
-  // save the fat version of this aabb
-  node.aabb = aabb_t::grow(aabb, growth);
-  // insert into the tree
-  if (_root == invalid_index) {
-    _root = index;
-    return;
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  workers.reserve(threads);
+  for (uint32_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      for (size_t i; (i = next++) < count;) {
+        task(t, i);
+      }
+    });
   }
-  if (_is_leaf(_root)) {
-    _root = _insert_into_leaf(_root, index);
+  for (auto &w : workers) {
+    w.join();
   }
-  _insert(index);
-#if VALIDATE
-  _validate(_root);
-#endif
 }
 
-void bvh_t::_free_all() {
-  _free_list = 0;
-  for (index_t i = 0; i < _max_nodes; ++i) {
-    _get(i).child[0] = i + 1;
-    _get(i).child[1] = invalid_index;
-    _get(i).parent = invalid_index;
-  }
-  // mark the end of the list of free nodes
-  _get(_max_nodes - 1).child[0] = invalid_index;
-  _get(_max_nodes - 1).child[1] = invalid_index;
-  _get(_max_nodes - 1).parent = invalid_index;
-  _root = invalid_index;
+// spread the lower 16 bits of v so that there is a zero between each bit
+uint32_t morton_spread(uint32_t v) {
+  v &= 0xffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
 }
 
-index_t bvh_t::_new_node() {
-  index_t out = _free_list;
-  assert(out != invalid_index);
-  _free_list = get(_free_list).child[0];
-  return out;
+// quantize a value in the range [lo, hi] to 16 bits
+uint32_t quantize(float v, float lo, float hi) {
+  const float t = (hi > lo) ? (v - lo) / (hi - lo) : 0.f;
+  return uint32_t(std::min(std::max(t, 0.f), 1.f) * 65535.f);
 }
 
-void bvh_t::_unlink(index_t index) {
-  // assume we only ever unlink a leaf
-  assert(_is_leaf(index));
-  auto &node = _get(index);
+// morton code for the center of an aabb within some bounds
+uint32_t morton_code(const bvh::aabb_t &a, const bvh::aabb_t &bounds) {
+  const float cx = (a.minx + a.maxx) * .5f;
+  const float cy = (a.miny + a.maxy) * .5f;
+  return morton_spread(quantize(cx, bounds.minx, bounds.maxx)) |
+        (morton_spread(quantize(cy, bounds.miny, bounds.maxy)) << 1);
+}
 
-  // special case root node
-  if (index == _root) {
-    assert(node.parent == invalid_index);
-    // case 1 (node was root)
-    _root = invalid_index;
-    return;
+// find where to split a sorted run of morton codes, at the highest bit which
+// differs across the run
+template <typename type_t>
+size_t morton_split(const type_t *m, size_t count) {
+  assert(count >= 2);
+  const uint32_t diff = m[0].code ^ m[count - 1].code;
+  if (diff == 0) {
+    // all codes are equal so just split down the middle
+    return count / 2;
   }
+  uint32_t bit = 1u << 31;
+  while (!(diff & bit)) {
+    bit >>= 1;
+  }
+  // codes with this bit clear come before codes with it set
+  const type_t *split = std::partition_point(m, m + count,
+    [bit](const type_t &x) { return (x.code & bit) == 0; });
+  return size_t(split - m);
+}
 
-  auto &p0 = _get(node.parent);
-
-  if (p0.parent == invalid_index) {
-
-    // case 2 (p0 is root)
-    //       P0
-    //  node     ?
-
-    // find the sibling node
-    index_t sib = (p0.child[0] == index) ? 1 : 0;
-    // promote as the new root
-    _root = p0.child[sib];
-    _get(_root).parent = invalid_index;
-    // free p0 node
-    _free_node(node.parent);
-    node.parent = invalid_index;
-    return;
+// add a value to a row of floats
+void add_row(float *row, int32_t count, float value) {
+  int32_t i = 0;
+#if BVH_SSE
+  const __m128 v = _mm_set1_ps(value);
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_ps(row + i, _mm_add_ps(_mm_loadu_ps(row + i), v));
+  }
+#endif
+  for (; i < count; ++i) {
+    row[i] += value;
   }
+}
 
-  auto &p1 = _get(p0.parent);
+}  // namespace {}
 
-  // case 3 (p0 is not root)
-  //              p1
-  //       p0
-  //  node     ?
+namespace bvh {
 
-  // find the configuration of p1 children
-  // find child index of p0 for p1
-  index_t p1c = (p1.child[0] == node.parent) ? 0 : 1;
-  assert(p1.child[p1c] == node.parent);
+// a leaf being sorted by the binned sah builder
+struct sah_leaf_t {
+  bvh::aabb_t aabb;
+  float cx, cy;
+  bvh::index_t index;
+  int bin;
+};
 
-  // find the configuration of p0 children
-  // find child index of 'node' for p0
-  index_t p0c = (p0.child[0] == index) ? 0 : 1;
-  assert(p0.child[p0c] == index);
+}  // namespace bvh
 
-  // promote sibling of 'node' into place of p0
-  // find sibling of 'node'
-  index_t sib = p0.child[p0c ^ 1];
-  assert(sib != invalid_index);
-  // promote sibling of 'node' into place of p0
-  p1.child[p1c] = sib;
-  _get(sib).parent = p0.parent;
+namespace {
 
-  // recalculate the remaining tree aabbs, p1 up
-  _touched_aabb(p0.parent);
+using bvh::sah_leaf_t;
 
-  // free p0
-  _free_node(node.parent);
-  // node is now unlinked
-  node.parent = invalid_index;
+// partition a run of leaves about the best binned sah split, returning the
+// index of the first leaf in the right half
+size_t sah_split(sah_leaf_t *leaves, size_t count) {
+  assert(count >= 2);
+  if (count == 2) {
+    return 1;
+  }
+  // find the bounds of the leaf centers
+  float minx = INFINITY, miny = INFINITY;
+  float maxx = -INFINITY, maxy = -INFINITY;
+  for (size_t i = 0; i < count; ++i) {
+    minx = std::min(minx, leaves[i].cx);
+    miny = std::min(miny, leaves[i].cy);
+    maxx = std::max(maxx, leaves[i].cx);
+    maxy = std::max(maxy, leaves[i].cy);
+  }
+  // split along the longest axis
+  const bool axis_x = (maxx - minx) >= (maxy - miny);
+  const float lo = axis_x ? minx : miny;
+  const float hi = axis_x ? maxx : maxy;
+  if (hi <= lo) {
+    // all centers are the same so just split down the middle
+    return count / 2;
+  }
+  // drop each leaf into a bin
+  const float scale = float(c_sah_bins) * .9999f / (hi - lo);
+  std::array<bvh::aabb_t, c_sah_bins> bin_aabb;
+  std::array<size_t, c_sah_bins> bin_count;
+  bin_count.fill(0);
+  for (size_t i = 0; i < count; ++i) {
+    sah_leaf_t &l = leaves[i];
+    const float c = axis_x ? l.cx : l.cy;
+    const int b = std::min(int((c - lo) * scale), c_sah_bins - 1);
+    bin_aabb[b] = bin_count[b] ? bvh::aabb_t::find_union(bin_aabb[b], l.aabb)
+                               : l.aabb;
+    ++bin_count[b];
+    l.bin = b;
+  }
+  // sweep from the right to find the cost of everything right of a split
+  std::array<float, c_sah_bins> right_cost;
+  bvh::aabb_t acc;
+  size_t num = 0;
+  for (int b = c_sah_bins - 1; b > 0; --b) {
+    if (bin_count[b]) {
+      acc = num ? bvh::aabb_t::find_union(acc, bin_aabb[b]) : bin_aabb[b];
+      num += bin_count[b];
+    }
+    right_cost[b] = num ? acc.area() * float(num) : 0.f;
+  }
+  // then sweep from the left to find the cheapest split
+  int best = 0;
+  float best_cost = INFINITY;
+  num = 0;
+  for (int b = 0; b < c_sah_bins - 1; ++b) {
+    if (bin_count[b]) {
+      acc = num ? bvh::aabb_t::find_union(acc, bin_aabb[b]) : bin_aabb[b];
+      num += bin_count[b];
+    }
+    if (num == 0 || num == count) {
+      continue;
+    }
+    const float cost = acc.area() * float(num) + right_cost[b + 1];
+    if (cost < best_cost) {
+      best_cost = cost;
+      best = b + 1;
+    }
+  }
+  sah_leaf_t *split = std::partition(leaves, leaves + count,
+    [best](const sah_leaf_t &l) { return l.bin < best; });
+  return size_t(split - leaves);
 }
 
-void bvh_t::_touched_aabb(index_t i) {
-  while (i != invalid_index) {
-    node_t &node = _get(i);
-    assert(!node.is_leaf());
-    assert(node.child[0] != invalid_index);
-    assert(node.child[1] != invalid_index);
-    node.aabb = aabb_t::find_union(_child(i, 0).aabb, _child(i, 1).aabb);
-    i = node.parent;
+// the sah cost (sum of interior node areas) a binned build of these leaves
+// would have. the leaves are reordered.
+float sah_cost(sah_leaf_t *leaves, size_t count, bvh::aabb_t &bounds) {
+  assert(count > 0);
+  if (count == 1) {
+    bounds = leaves[0].aabb;
+    return 0.f;
   }
+  const size_t split = sah_split(leaves, count);
+  bvh::aabb_t b0, b1;
+  const float c0 = sah_cost(leaves, split, b0);
+  const float c1 = sah_cost(leaves + split, count - split, b1);
+  bounds = bvh::aabb_t::find_union(b0, b1);
+  return c0 + c1 + bounds.area();
 }
 
-void bvh_t::_free_node(index_t index) {
-  assert(index != invalid_index);
-  auto &node = _get(index);
-  node.child[0] = _free_list;
-  _free_list = index;
+// first page of a paged tree file
+struct paged_file_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t page_size;
+  // reference to the root, a top level node or the ones complement of a page
+  int32_t root;
+  uint32_t unused;
+  uint64_t leaves;
+  uint64_t pages;
+  uint64_t top_nodes;
+  // offset of the top level nodes, which follow the pages
+  uint64_t top_offset;
+  bvh::aabb_t bounds;
+};
+
+static const char c_paged_magic[8] = { 'b', 'v', 'h', 'p', 'a', 'g', 'e', 'd' };
+static const uint32_t c_paged_version = 2;
+
+// start of each page of a paged tree, followed by its nodes and then leaves
+struct page_header_t {
+  uint32_t leaves;
+  uint32_t nodes;
+  // reference to the root, a node or the ones complement of a leaf
+  int32_t root;
+  uint32_t unused;
+};
+
+// marks the ends of the page cache lru list
+static const uint32_t c_no_slot = ~0u;
+
+// page held by a cache slot whose read failed
+static const uint64_t c_no_page = ~uint64_t(0);
+
+// largest page size accepted when opening a file
+static const uint32_t c_max_page_size = 1u << 24;
+
+// number of leaves which fit in a page along with a subtree over them
+uint32_t leaves_per_page(uint32_t page_size) {
+  // n leaves need n - 1 nodes
+  return uint32_t((page_size - sizeof(page_header_t) +
+                   sizeof(bvh::paged_node_t)) /
+                  (sizeof(bvh::paged_node_t) + sizeof(bvh::paged_leaf_t)));
 }
 
-void bvh_t::_validate(index_t index) {
-  if (index == invalid_index) {
-    return;
+// check that the header of a paged tree fits a file of 'size' bytes
+bool paged_file_fits(const paged_file_t &file, uint64_t size) {
+  // a page must hold a header and at least two leaves
+  if (file.page_size < sizeof(file) || file.page_size > c_max_page_size ||
+      (file.page_size % 8) != 0 || leaves_per_page(file.page_size) < 2) {
+    return false;
   }
+  // an empty tree is written as the header alone
+  if (file.pages == 0) {
+    return file.leaves == 0 && file.top_nodes == 0 && file.root == 0;
+  }
+  // the header page, the pages and then the top levels fill the file
+  const uint64_t pages_end = (file.pages + 1) * file.page_size;
+  if (file.pages >= size / file.page_size || file.top_offset != pages_end ||
+      file.top_nodes > (size - pages_end) / sizeof(bvh::paged_node_t) ||
+      pages_end + file.top_nodes * sizeof(bvh::paged_node_t) != size) {
+    return false;
+  }
+  // every page holds between one and a full page of leaves
+  if (file.leaves < file.pages ||
+      file.leaves > file.pages * leaves_per_page(file.page_size) ||
+      file.top_nodes != file.pages - 1) {
+    return false;
+  }
+  // the root is the last top level node or a lone page
+  if (file.top_nodes) {
+    return uint64_t(file.root) + 1 == file.top_nodes;
+  }
+  return file.root == ~int32_t(0);
+}
 
-  auto &node = _get(index);
-
-  if (index == _root) {
-    assert(_get(index).parent == invalid_index);
+// check that a page read from a file holds a well formed subtree, whose
+// nodes each come before their children, so walking it stays in the page
+bool page_is_valid(const uint8_t *data, uint32_t page_size) {
+  const page_header_t &head = *reinterpret_cast<const page_header_t*>(data);
+  if (head.leaves == 0 || head.leaves > leaves_per_page(page_size) ||
+      head.nodes != head.leaves - 1) {
+    return false;
   }
-  // check parents children
-  if (node.parent != invalid_index) {
-    auto &parent = _get(node.parent);
-    assert(parent.child[0] != parent.child[1]);
-    assert(parent.child[0] == index ||
-           parent.child[1] == index);
+  if (head.nodes == 0) {
+    return head.root == ~int32_t(0);
   }
-  if (_is_leaf(index)) {
-    // leaves should have no children
-    assert(node.child[0] == invalid_index);
-    assert(node.child[1] == invalid_index);
+  if (head.root != 0) {
+    return false;
   }
-  else {
-    // interior nodes should have two children
-    assert(node.child[0] != invalid_index);
-    assert(node.child[1] != invalid_index);
-    // validate childrens parent indices
-    assert(_child(index, 0).parent == index);
-    assert(_child(index, 1).parent == index);
-    // validate aabbs
-    assert(node.aabb.contains(_child(index, 0).aabb));
-    assert(node.aabb.contains(_child(index, 1).aabb));
-    // validate child nodes
-    _validate(node.child[0]);
-    _validate(node.child[1]);
+  const bvh::paged_node_t *nodes =
+    reinterpret_cast<const bvh::paged_node_t*>(data + sizeof(page_header_t));
+  for (uint32_t i = 0; i < head.nodes; ++i) {
+    for (int32_t c : nodes[i].child) {
+      if (c >= 0 ? (uint32_t(c) <= i || uint32_t(c) >= head.nodes)
+                 : (uint32_t(~c) >= head.leaves)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
 
-    // XXX: check area of aabb is minimal?
+// write all of a buffer at an offset in a file
+bool write_at(int fd, const void *data, size_t size, uint64_t offset) {
+  const uint8_t *p = static_cast<const uint8_t*>(data);
+  while (size) {
+    const ssize_t done = pwrite(fd, p, size, off_t(offset));
+    if (done <= 0) {
+      return false;
+    }
+    p += done;
+    size -= size_t(done);
+    offset += uint64_t(done);
   }
+  return true;
 }
 
-void bvh_t::_optimize(node_t &node) {
+// read all of a buffer from an offset in a file
+bool read_at(int fd, void *data, size_t size, uint64_t offset) {
+  uint8_t *p = static_cast<uint8_t*>(data);
+  while (size) {
+    const ssize_t done = pread(fd, p, size, off_t(offset));
+    if (done <= 0) {
+      return false;
+    }
+    p += done;
+    size -= size_t(done);
+    offset += uint64_t(done);
+  }
+  return true;
+}
 
-#if VALIDATE
-  const float before = quality();
-#endif
+// a leaf waiting to be written to a paged tree, with its morton code
+struct paged_entry_t {
+  uint32_t code;
+  bvh::paged_index_t index;
+  bvh::aabb_t aabb;
 
-  // four possible rotations
-  //
-  //        n                   n
-  //   c0       c1         c0      *x0
-  // x0  x1             *c1  x1
-  //
-  //        n                   n
-  //   c0       c1         c0      *x1
-  // x0  x1              x0 *c1
-  //
-  // same as above but with c0 and c1 roles swapped
+  bool operator < (const paged_entry_t &rhs) const {
+    return (code == rhs.code) ? (index < rhs.index) : (code < rhs.code);
+  }
+};
 
-  for (int i = 0; i < 2; ++i) {
+// writes a paged tree file given its leaves in morton order. each page is
+// written as soon as it fills, and the top levels are built bottom up over
+// the finished pages by joining neighbouring subtrees of equal height.
+struct paged_writer_t {
 
-    // gen 1
-    const auto c0i = node.child[0];
-    const auto c1i = node.child[1];
-    if (c0i == invalid_index || c1i == invalid_index) {
-      return;
+  ~paged_writer_t() {
+    if (fd >= 0) {
+      ::close(fd);
     }
-    auto &c0 = _get(c0i);
-    auto &c1 = _get(c1i);
+  }
 
-    // gen 2
-    const auto x0i = c0.child[0];
-    const auto x1i = c0.child[1];
-    if (x0i == invalid_index || x1i == invalid_index) {
-      // swap c0 and c1 and try again (rotations 3 and 4)
-      std::swap(node.child[0], node.child[1]);
-      continue;
-    }
-    auto &x0 = _get(x0i);
-    auto &x1 = _get(x1i);
+  bool open(const char *path, uint32_t size, const bvh::aabb_t &b) {
+    page_size = size;
+    per_page = leaves_per_page(size);
+    assert(per_page >= 2 && (size % 8) == 0);
+    bounds = b;
+    page.resize(size);
+    run.reserve(per_page);
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return fd >= 0;
+  }
 
-    // note: this heuristic only looks at minimizing the area of c0
-    //       which is all that is affected by these rotations
+  // add the next leaf in morton order
+  bool add(const paged_entry_t &e) {
+    run.push_back(e);
+    ++leaves;
+    return (run.size() < per_page) || flush();
+  }
 
-    // current
-    const float h0 = c0.aabb.area();
-    // rotation 1
-    const aabb_t a1 = aabb_t::find_union(c1.aabb, x1.aabb);
-    const float h1 = a1.area();
-    // rotation 2
-    const aabb_t a2 = aabb_t::find_union(x0.aabb, c1.aabb);
-    const float h2 = a2.area();
+  // write the last page, the top levels and then the file header
+  bool finish() {
+    if (!run.empty() && !flush()) {
+      return false;
+    }
+    while (pending.size() > 1) {
+      join();
+    }
+    paged_file_t file;
+    memset(&file, 0, sizeof(file));
+    memcpy(file.magic, c_paged_magic, sizeof(file.magic));
+    file.version = c_paged_version;
+    file.page_size = page_size;
+    file.root = pending.empty() ? 0 : pending[0].ref;
+    file.leaves = leaves;
+    file.pages = pages;
+    file.top_nodes = top.size();
+    file.top_offset = (pages + 1) * page_size;
+    file.bounds = bounds;
+    const bool ok =
+      write_at(fd, top.data(), top.size() * sizeof(bvh::paged_node_t),
+               file.top_offset) &&
+      write_at(fd, &file, sizeof(file), 0);
+    return (::close(std::exchange(fd, -1)) == 0) && ok;
+  }
 
-    if (h1 < h2) {
-      if (h1 < h0) {
-        // do rotation 1 (swap x0/c1)
-        //        n                   n
-        //   c0       c1  ->     c0      *x0
-        // x0  x1             *c1  x1
-        //
-        c1.parent = c0i;
-        x0.parent = c0.parent;
-        std::swap(c0.child[0], node.child[1]); // x0 and c1
-        c0.aabb = a1;
-        assert(c0.aabb.contains(c1.aabb));
-        assert(c0.aabb.contains(x1.aabb));
-      }
-    } else {
-      if (h2 < h0) {
-        // do rotation 2 (swap x1/c1)
-        //        n                   n
-        //   c0       c1  ->     c0      *x1
-        // x0  x1              x0 *c1
-        //
-        c1.parent = c0i;
-        x1.parent = c0.parent;
-        std::swap(c0.child[1], node.child[1]); // x1 and c1
-        c0.aabb = a2;
-        assert(c0.aabb.contains(x0.aabb));
-        assert(c0.aabb.contains(c1.aabb));
-      }
+  // write the run of leaves as a page
+  bool flush() {
+    // pages are referred to by the ones complement of an int32_t
+    if (pages >= uint64_t(std::numeric_limits<int32_t>::max())) {
+      return false;
     }
-    // swap c0 and c1 and try again (rotations 3 and 4)
-    std::swap(node.child[0], node.child[1]);
+    std::fill(page.begin(), page.end(), uint8_t(0));
+    page_header_t &head = *reinterpret_cast<page_header_t*>(page.data());
+    bvh::paged_node_t *nodes =
+      reinterpret_cast<bvh::paged_node_t*>(page.data() + sizeof(page_header_t));
+    bvh::paged_leaf_t *slots = reinterpret_cast<bvh::paged_leaf_t*>(
+      page.data() + sizeof(page_header_t) +
+      (run.size() - 1) * sizeof(bvh::paged_node_t));
+    head.leaves = uint32_t(run.size());
+    head.nodes = 0;
+    bvh::aabb_t b;
+    head.root = build(run.data(), run.size(), 0, nodes, head.nodes, b);
+    assert(head.nodes == run.size() - 1);
+    for (size_t i = 0; i < run.size(); ++i) {
+      slots[i] = bvh::paged_leaf_t{ run[i].aabb, run[i].index };
+    }
+    if (!write_at(fd, page.data(), page.size(), (pages + 1) * page_size)) {
+      return false;
+    }
+    pending.push_back(pending_t{ ~int32_t(pages), b, 0 });
+    ++pages;
+    run.clear();
+    // join finished subtrees of equal height, like carrying in a counter
+    while (pending.size() >= 2 &&
+           pending[pending.size() - 1].height ==
+           pending[pending.size() - 2].height) {
+      join();
+    }
+    return true;
   }
 
-#if VALIDATE
-  const float after = quality();
-  assert(after - 1.f <= before);
-#endif
+  // build a subtree over a run of leaves in pre order, giving its bounds
+  int32_t build(const paged_entry_t *m, size_t count, size_t first,
+                bvh::paged_node_t *nodes, uint32_t &used, bvh::aabb_t &b) {
+    if (count == 1) {
+      b = m[0].aabb;
+      return ~int32_t(first);
+    }
+    const int32_t self = int32_t(used++);
+    const size_t split = morton_split(m, count);
+    bvh::paged_node_t &n = nodes[self];
+    n.child[0] = build(m, split, first, nodes, used, n.bounds[0]);
+    n.child[1] = build(m + split, count - split, first + split, nodes, used,
+                       n.bounds[1]);
+    b = bvh::aabb_t::find_union(n.bounds[0], n.bounds[1]);
+    return self;
+  }
+
+  // join the two most recent subtrees under a new top level node
+  void join() {
+    const pending_t r = pending.back();
+    pending.pop_back();
+    const pending_t l = pending.back();
+    pending.pop_back();
+    top.push_back(bvh::paged_node_t{ { l.bounds, r.bounds }, { l.ref, r.ref } });
+    pending.push_back(pending_t{ int32_t(top.size() - 1),
+                                 bvh::aabb_t::find_union(l.bounds, r.bounds),
+                                 std::max(l.height, r.height) + 1 });
+  }
+
+  // a finished subtree waiting for a parent
+  struct pending_t {
+    int32_t ref;
+    bvh::aabb_t bounds;
+    uint32_t height;
+  };
+
+  int fd = -1;
+  uint32_t page_size = 0;
+  uint32_t per_page = 0;
+  bvh::aabb_t bounds = {};
+  uint64_t leaves = 0;
+  uint64_t pages = 0;
+  // leaves of the page being filled
+  std::vector<paged_entry_t> run;
+  // bytes of the page being written
+  std::vector<uint8_t> page;
+  std::vector<bvh::paged_node_t> top;
+  std::vector<pending_t> pending;
+};
+
+// start of a snapshot file written by write_boxes(), followed by the boxes
+struct boxes_file_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t unused;
+  uint64_t count;
+  bvh::aabb_t bounds;
+};
+
+static const char c_boxes_magic[8] = { 'b', 'v', 'h', 'b', 'o', 'x', 'e', 's' };
+static const uint32_t c_boxes_version = 1;
+
+// read and check the header of a snapshot file
+bool read_boxes_header(int fd, boxes_file_t &file) {
+  struct stat st;
+  return read_at(fd, &file, sizeof(file), 0) &&
+         memcmp(file.magic, c_boxes_magic, sizeof(file.magic)) == 0 &&
+         file.version == c_boxes_version && fstat(fd, &st) == 0 &&
+         uint64_t(st.st_size) ==
+             sizeof(file) + file.count * sizeof(bvh::aabb_t);
 }
 
-void bvh_t::find_overlaps(const aabb_t &bb, std::vector<index_t> &overlaps) {
-  std::vector<index_t> stack;
-  stack.reserve(128);
-  if (_root != invalid_index) {
-    stack.push_back(_root);
+#if BVH_IO_URING
+// the parts of io_uring needed to read a file ahead, used through the raw
+// system calls
+struct uring_t {
+
+  ~uring_t() {
+    release();
   }
-  while (!stack.empty()) {
-    // pop one node
-    const index_t ni = stack.back();
-    assert(ni != invalid_index);
-    const node_t &n = _get(ni);
 
-    // if these aabbs overlap
-    if (aabb_t::overlaps(bb, n.aabb)) {
-      if (n.is_leaf()) {
-        overlaps.push_back(ni);
+  bool setup(uint32_t entries) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = int(syscall(__NR_io_uring_setup, entries, &p));
+    if (fd < 0) {
+      return false;
+    }
+    const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (single) {
+      sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+    sq = map(sq_size, IORING_OFF_SQ_RING);
+    cq = single ? sq : map(cq_size, IORING_OFF_CQ_RING);
+    sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(map(sqes_size, IORING_OFF_SQES));
+    if (!sq || !cq || !sqes) {
+      release();
+      return false;
+    }
+    uint8_t *s = static_cast<uint8_t*>(sq);
+    uint8_t *c = static_cast<uint8_t*>(cq);
+    sq_tail = reinterpret_cast<uint32_t*>(s + p.sq_off.tail);
+    sq_mask = *reinterpret_cast<uint32_t*>(s + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<uint32_t*>(s + p.sq_off.array);
+    cq_head = reinterpret_cast<uint32_t*>(c + p.cq_off.head);
+    cq_tail = reinterpret_cast<uint32_t*>(c + p.cq_off.tail);
+    cq_mask = *reinterpret_cast<uint32_t*>(c + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(c + p.cq_off.cqes);
+    return true;
+  }
+
+  // queue a read and submit it. the caller keeps no more reads in flight
+  // than the ring was set up with.
+  bool read(int file, void *data, uint32_t size, uint64_t offset,
+            uint64_t user) {
+    const uint32_t tail = *sq_tail;
+    const uint32_t i = tail & sq_mask;
+    io_uring_sqe &e = sqes[i];
+    memset(&e, 0, sizeof(e));
+    e.opcode = IORING_OP_READ;
+    e.fd = file;
+    e.addr = uint64_t(uintptr_t(data));
+    e.len = size;
+    e.off = offset;
+    e.user_data = user;
+    sq_array[i] = i;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0) == 1;
+  }
+
+  // wait for any read to complete
+  bool wait(uint64_t &user, int32_t &result) {
+    for (;;) {
+      const uint32_t head = *cq_head;
+      if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        const io_uring_cqe &c = cqes[head & cq_mask];
+        user = c.user_data;
+        result = c.res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
       }
-      else {
-        assert(n.child[0] != invalid_index);
-        assert(n.child[1] != invalid_index);
-        stack.back() = n.child[0];
-        stack.push_back(n.child[1]);
-        continue;
+      if (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS,
+                  nullptr, 0) < 0 && errno != EINTR) {
+        return false;
       }
     }
-    // pop node from the stack
-    stack.resize(stack.size() - 1);
   }
-}
 
-void bvh_t::find_overlaps(index_t node, std::vector<index_t> &overlaps) {
-  const node_t &n = _get(node);
-  find_overlaps(n.aabb, overlaps);
-}
+  void *map(size_t size, uint64_t offset) {
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, off_t(offset));
+    return (p == MAP_FAILED) ? nullptr : p;
+  }
+
+  void release() {
+    if (sqes) {
+      munmap(sqes, sqes_size);
+    }
+    if (cq && cq != sq) {
+      munmap(cq, cq_size);
+    }
+    if (sq) {
+      munmap(sq, sq_size);
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    sq = cq = nullptr;
+    sqes = nullptr;
+    fd = -1;
+  }
+
+  int fd = -1;
+  void *sq = nullptr;
+  void *cq = nullptr;
+  size_t sq_size = 0;
+  size_t cq_size = 0;
+  size_t sqes_size = 0;
+  io_uring_sqe *sqes = nullptr;
+  io_uring_cqe *cqes = nullptr;
+  uint32_t *sq_tail = nullptr;
+  uint32_t *sq_array = nullptr;
+  uint32_t *cq_head = nullptr;
+  uint32_t *cq_tail = nullptr;
+  uint32_t sq_mask = 0;
+  uint32_t cq_mask = 0;
+};
+#endif
+
+// reads a file in order, in fixed size chunks, keeping reads in flight in a
+// ring of buffers ahead of the consumer. chunk k is read into slot k % depth
+// and a slot is read into again once its chunk is released.
+struct chunk_stream_t {
+
+  ~chunk_stream_t() {
+#if BVH_IO_URING
+    // the kernel may still be writing into the buffers
+    uint64_t user = 0;
+    int32_t result = 0;
+    while (in_flight && ring.wait(user, result)) {
+      --in_flight;
+    }
+#endif
+    if (reader.joinable()) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+      }
+      wake.notify_all();
+      reader.join();
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  bool open(const char *path, uint64_t offset, size_t chunk_bytes,
+            uint32_t slots, bool uring) {
+    assert(chunk_bytes > 0 && slots > 0);
+    fd = ::open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      return false;
+    }
+    base = offset;
+    size = (uint64_t(st.st_size) > base) ? uint64_t(st.st_size) - base : 0;
+    chunk = chunk_bytes;
+    depth = slots;
+    chunks = (size + chunk - 1) / chunk;
+    buffers.resize(depth);
+    for (std::vector<uint8_t> &b : buffers) {
+      b.resize(chunk);
+    }
+    filled.assign(depth, -1);
+#if BVH_IO_URING
+    if (uring && ring.setup(depth)) {
+      use_uring = true;
+      while (issued < chunks && issued < depth) {
+        if (!submit()) {
+          return false;
+        }
+      }
+      return true;
+    }
+#else
+    (void)uring;
+#endif
+    reader = std::thread([this]() { read_ahead(); });
+    return true;
+  }
+
+  // wait for the next chunk, returning false at the end of the file or on
+  // an error
+  bool next(const uint8_t *&data, size_t &bytes) {
+    if (failed || taken == chunks) {
+      return false;
+    }
+    const size_t slot = size_t(taken % depth);
+#if BVH_IO_URING
+    if (use_uring) {
+      while (filled[slot] < 0) {
+        uint64_t user = 0;
+        int32_t result = 0;
+        if (!ring.wait(user, result)) {
+          failed = true;
+          return false;
+        }
+        --in_flight;
+        if (!complete(user, result)) {
+          failed = true;
+          return false;
+        }
+      }
+    }
+#endif
+    if (!use_uring) {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [&]() { return failed || filled[slot] >= 0; });
+      if (failed) {
+        return false;
+      }
+    }
+    data = buffers[slot].data();
+    bytes = size_t(filled[slot]);
+    ++taken;
+    return true;
+  }
+
+  // hand back the buffer of the last chunk so it can be read into again
+  void release() {
+    const size_t slot = size_t((taken - 1) % depth);
+#if BVH_IO_URING
+    if (use_uring) {
+      filled[slot] = -1;
+      if (issued < chunks && !submit()) {
+        failed = true;
+      }
+      return;
+    }
+#endif
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      filled[slot] = -1;
+      ++released;
+    }
+    wake.notify_all();
+  }
+
+  // bytes in a chunk, the last of which may be short
+  size_t chunk_size(uint64_t k) const {
+    return size_t(std::min<uint64_t>(chunk, size - k * chunk));
+  }
+
+#if BVH_IO_URING
+  bool submit() {
+    const uint64_t k = issued++;
+    if (!ring.read(fd, buffers[k % depth].data(), uint32_t(chunk_size(k)),
+                   base + k * chunk, k)) {
+      return false;
+    }
+    ++in_flight;
+    return true;
+  }
+
+  // record a completed read, finishing it by hand if it came up short
+  bool complete(uint64_t k, int32_t result) {
+    const size_t want = chunk_size(k);
+    if (result < 0 || size_t(result) > want) {
+      return false;
+    }
+    uint8_t *data = buffers[k % depth].data();
+    if (!read_at(fd, data + result, want - size_t(result),
+                 base + k * chunk + uint64_t(result))) {
+      return false;
+    }
+    filled[k % depth] = int64_t(want);
+    return true;
+  }
+#endif
+
+  // body of the reader thread
+  void read_ahead() {
+    for (uint64_t k = 0; k < chunks; ++k) {
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [&]() { return stopping || k < released + depth; });
+        if (stopping) {
+          return;
+        }
+      }
+      const size_t want = chunk_size(k);
+      const bool ok =
+          read_at(fd, buffers[k % depth].data(), want, base + k * chunk);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if (ok) {
+          filled[k % depth] = int64_t(want);
+        }
+        else {
+          failed = true;
+        }
+      }
+      wake.notify_all();
+      if (!ok) {
+        return;
+      }
+    }
+  }
+
+  int fd = -1;
+  // offset of the first chunk and bytes from there to the end of the file
+  uint64_t base = 0;
+  uint64_t size = 0;
+  size_t chunk = 0;
+  uint32_t depth = 0;
+  uint64_t chunks = 0;
+  // chunks handed to the consumer
+  uint64_t taken = 0;
+  // chunks released by the consumer
+  uint64_t released = 0;
+  // chunks whose reads have been queued
+  uint64_t issued = 0;
+  std::vector<std::vector<uint8_t>> buffers;
+  // bytes read into each slot, or -1 while its read is in flight
+  std::vector<int64_t> filled;
+  bool failed = false;
+  bool stopping = false;
+  bool use_uring = false;
+#if BVH_IO_URING
+  uring_t ring;
+  // reads queued on the ring and not yet completed
+  uint64_t in_flight = 0;
+#endif
+  std::mutex lock;
+  std::condition_variable wake;
+  std::thread reader;
+};
+
+// a morton sorted run of leaves spilled to a file
+struct spill_run_t {
+  uint64_t offset;
+  uint64_t count;
+};
+
+// a temporary file of spilled runs, removed once closed
+struct spill_file_t {
+
+  ~spill_file_t() {
+    close();
+  }
+
+  bool open(const std::string &name) {
+    close();
+    path = name;
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    return fd >= 0;
+  }
+
+  void close() {
+    if (fd >= 0) {
+      ::close(fd);
+      unlink(path.c_str());
+    }
+    fd = -1;
+    end = 0;
+  }
+
+  // append a sorted run of entries to the end of the file
+  bool append(const paged_entry_t *e, size_t count) {
+    const size_t bytes = count * sizeof(paged_entry_t);
+    const bool ok = write_at(fd, e, bytes, end);
+    end += bytes;
+    return ok;
+  }
+
+  int fd = -1;
+  std::string path;
+  uint64_t end = 0;
+};
+
+// reads a spilled run back in order through a small buffer
+struct run_reader_t {
+
+  bool start(int file, const spill_run_t &run, size_t entries) {
+    fd = file;
+    offset = run.offset;
+    left = run.count;
+    buffer.resize(std::max<size_t>(entries, 1));
+    return refill();
+  }
+
+  // the entry at the head of the run
+  const paged_entry_t &head() const {
+    return buffer[pos];
+  }
+
+  // step past the head, returning false at the end of the run or if the
+  // next entries could not be read
+  bool advance() {
+    return (++pos < size) || refill();
+  }
+
+  bool refill() {
+    pos = 0;
+    size = size_t(std::min<uint64_t>(left, buffer.size()));
+    if (size == 0) {
+      return false;
+    }
+    const size_t bytes = size * sizeof(paged_entry_t);
+    if (!read_at(fd, buffer.data(), bytes, offset)) {
+      failed = true;
+      size = 0;
+      return false;
+    }
+    offset += bytes;
+    left -= size;
+    return true;
+  }
+
+  int fd = -1;
+  uint64_t offset = 0;
+  // entries of the run not yet read into the buffer
+  uint64_t left = 0;
+  std::vector<paged_entry_t> buffer;
+  size_t pos = 0;
+  size_t size = 0;
+  bool failed = false;
+};
+
+// merge spilled runs in morton order, giving each entry in turn to a sink
+// which returns false to stop. 'entries' is the buffer size of each run.
+template <typename sink_t>
+bool merge_runs(int fd, const spill_run_t *runs, size_t count, size_t entries,
+                sink_t &sink) {
+  std::vector<run_reader_t> readers(count);
+  // readers which have entries left, as a heap on their head entries
+  std::vector<uint32_t> heap;
+  for (size_t r = 0; r < count; ++r) {
+    if (readers[r].start(fd, runs[r], entries)) {
+      heap.push_back(uint32_t(r));
+    }
+    else if (readers[r].failed) {
+      return false;
+    }
+  }
+  const auto later = [&](uint32_t a, uint32_t b) {
+    return readers[b].head() < readers[a].head();
+  };
+  std::make_heap(heap.begin(), heap.end(), later);
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    run_reader_t &r = readers[heap.back()];
+    if (!sink(r.head())) {
+      return false;
+    }
+    if (r.advance()) {
+      std::push_heap(heap.begin(), heap.end(), later);
+    }
+    else if (r.failed) {
+      return false;
+    }
+    else {
+      heap.pop_back();
+    }
+  }
+  return true;
+}
+
+// start of a shared tree segment, followed by the nodes of both copies
+struct shared_header_t {
+  char magic[8];
+  uint32_t version;
+  // nodes in each copy
+  uint32_t nodes;
+  // latest version published. its copy is given by the low bit.
+  std::atomic<uint64_t> published;
+  // per copy sequence count, odd while the writer is filling the copy
+  std::atomic<uint64_t> sequence[2];
+  // version held in each copy and the root of its tree
+  uint64_t held[2];
+  bvh::index_t root[2];
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "shared trees need lock free atomics across processes");
+
+static const char c_shared_magic[8] = { 'b', 'v', 'h', 's', 'h', 'a', 'r', 'e' };
+static const uint32_t c_shared_version = 1;
+// offset of the nodes of the first copy
+static const size_t c_shared_nodes = 128;
+static_assert(sizeof(shared_header_t) <= c_shared_nodes,
+              "shared header overlaps the nodes");
+
+// bytes in a segment with room for 'nodes' nodes in each copy
+size_t shared_size(size_t nodes) {
+  return c_shared_nodes + 2 * nodes * sizeof(bvh::shared_node_t);
+}
+
+#if BVH_NUMA
+// numa node of each cpu, found once
+const std::vector<uint32_t> &cpu_nodes() {
+  static const std::vector<uint32_t> table = []() {
+    std::vector<uint32_t> t(size_t(std::max(numa_num_configured_cpus(), 1)));
+    for (size_t c = 0; c < t.size(); ++c) {
+      const int node = numa_node_of_cpu(int(c));
+      t[c] = (node < 0) ? 0 : uint32_t(node);
+    }
+    return t;
+  }();
+  return table;
+}
+#endif
+
+}  // namespace {}
+
+namespace bvh {
+
+bool aabb_t::raycast(float x0, float y0, float x1, float y1) const {
+  return ::raycast(x0, y0, x1, y1, *this);
+}
+
+bvh_t::bvh_t()
+  : growth(16.f)
+  , auto_growth(false)
+  , maintenance(maintenance_t::reinsert)
+  , degraded_ratio(1.5f)
+  , _free_list(invalid_index)
+  , _root(invalid_index)
+  , _num_nodes(0)
+  , _epoch(1)
+  , _checked_epoch(0)
+{
+  clear();
+}
+
+void bvh_t::clear() {
+  _free_all();
+  _root = invalid_index;
+  _frame = frame_stats_t();
+  _history.clear();
+  _policy = policy_t();
+  _growth_history.clear();
+  _tuner = tuner_t();
+  _queries.clear();
+  _dead.clear();
+  _mark_built();
+}
+
+memory_usage_t bvh_t::memory_usage() const {
+  memory_usage_t out;
+  // a tree of n leaves always has n-1 interior nodes
+  const size_t leaves = (_num_nodes + 1) / 2;
+  out.nodes_used = size_t(_num_nodes) * sizeof(node_t);
+  out.nodes_reserved = sizeof(_nodes);
+  // sibling search heap used by insert and the query traversal stack
+  out.scratch = sizeof(sibling_heap_t) + c_stack_reserve * sizeof(index_t);
+  out.payload = leaves * sizeof(void*);
+  out.side = _history.capacity() * sizeof(frame_stats_t) +
+             _growth_history.capacity() * sizeof(growth_sample_t) +
+             _dead.capacity() * sizeof(index_t) +
+             sizeof(_keys) + sizeof(_sah_refs);
+  out.side_per_node = sizeof(_keys[0]) + sizeof(_sah_refs[0]);
+  for (const auto &q : _queries) {
+    out.side += sizeof(q) + q.second.result.capacity() * sizeof(index_t);
+  }
+  return out;
+}
+
+bool bvh_t::_is_leaf(index_t index) const {
+  return get(index).is_leaf();
+}
+
+// return a quality metric for this subtree
+float bvh_t::_quality(index_t n) const {
+  if (n == invalid_index) {
+    return 0.f;
+  }
+  const node_t &node = _get(n);
+  if (node.is_leaf()) {
+    return 0.f;
+  }
+  // cost metric is the sum of the surface area of all interior nodes (non root or leaf)
+  return ((n == _root) ? 0.f : node.aabb.area()) +
+    _quality(node.child[0]) +
+    _quality(node.child[1]);
+}
+
+index_t bvh_t::_insert_beside(index_t sib, index_t node) {
+  // create new internal node
+  index_t inter = _new_node();
+  // insert children
+  _get(inter).child[0] = sib;
+  _get(inter).child[1] = node;
+  // keep track of the parents
+  _get(inter).parent = invalid_index;  // fixed up by callee
+  _get(sib).parent = inter;
+  _get(node).parent = inter;
+  // recalculate the aabb on way up
+  _refit(inter);
+  // new child is the intermediate node
+  return inter;
+}
+
+index_t bvh_t::_new_leaf(const aabb_t &aabb, void *user_data) {
+  // create the new node
+  index_t index = _new_node();
+  assert(index != invalid_index);
+  auto &node = _get(index);
+  // grow the aabb by a factor
+  node.aabb = aabb_t::grow(aabb, growth);
+  node.tight = aabb;
+  node.stamp = _epoch;
+  // 
+  node.user_data = user_data;
+  node.parent = invalid_index;
+  node.count = 1;
+  node.asleep = false;
+  _keys[index] = 0.f;
+  // mark that this is a leaf
+  node.child[0] = invalid_index;
+  node.child[1] = invalid_index;
+  return index;
+}
+
+index_t bvh_t::insert(const aabb_t &aabb, void *user_data) {
+  // create the new node
+  const index_t index = _new_leaf(aabb, user_data);
+  // insert into the tree
+  _insert(index);
+#if VALIDATE
+  _validate(_root);
+#endif
+  // return this index
+  return index;
+}
+
+void bvh_t::_recalc_aabbs(index_t i) {
+  // walk from leaf to root recalculating aabbs
+  while (i != invalid_index) {
+    node_t &y = _get(i);
+    _refit(i);
+    _optimize(y);
+    ++_frame.update_nodes;
+    i = y.parent;
+  }
+}
+
+index_t bvh_t::_find_best_sibling(const aabb_t &aabb, uint64_t &visits) const {
+
+  sibling_heap_t pqueue;
+
+  if (_root != invalid_index) {
+    pqueue.push(search_t{ _root, 0.f });
+  }
+
+  float best_cost = INFINITY;
+  index_t best_index = invalid_index;
+
+  while (!pqueue.empty()) {
+    // pop one node (lowest cost so far)
+    const search_t s = pqueue.pop();
+    const node_t &n = _get(s.index);
+    ++visits;
+    // find the cost for inserting into this node
+    const aabb_t uni = aabb_t::find_union(aabb, n.aabb);
+    const float growth = uni.area() - n.aabb.area();
+    assert(growth >= 0.f);
+    const float cost = s.cost + growth;
+    // skip the entire subtree if we know we have a better choice
+    if (cost >= best_cost) {
+      continue;
+    }
+    if (n.is_leaf()) {
+      best_cost = cost;
+      best_index = s.index;
+    }
+    else {
+      assert(n.child[0] != invalid_index);
+      assert(n.child[1] != invalid_index);
+      pqueue.push(search_t{ n.child[0], cost });
+      pqueue.push(search_t{ n.child[1], cost });
+    }
+  }
+  // return the best leaf we cound find
+  return best_index;
+}
+
+index_t bvh_t::_find_best_node(const aabb_t &aabb, uint64_t &visits) const {
+
+  sibling_heap_t pqueue;
+
+  if (_root != invalid_index) {
+    pqueue.push(search_t{ _root, 0.f });
+  }
+
+  float best_cost = INFINITY;
+  index_t best_index = invalid_index;
+
+  while (!pqueue.empty()) {
+    // pop one node along with the growth its ancestors would see
+    const search_t s = pqueue.pop();
+    const node_t &n = _get(s.index);
+    ++visits;
+    // cost of a new parent over this node plus the growth of its ancestors
+    const aabb_t uni = aabb_t::find_union(aabb, n.aabb);
+    const float cost = s.cost + uni.area();
+    if (cost < best_cost) {
+      best_cost = cost;
+      best_index = s.index;
+    }
+    if (n.is_leaf()) {
+      continue;
+    }
+    // a sibling further down costs at least the area of the new aabb plus
+    // the growth of every ancestor, including this node
+    const float inherited = s.cost + uni.area() - n.aabb.area();
+    if (inherited + aabb.area() < best_cost) {
+      assert(n.child[0] != invalid_index);
+      assert(n.child[1] != invalid_index);
+      pqueue.push(search_t{ n.child[0], inherited });
+      pqueue.push(search_t{ n.child[1], inherited });
+    }
+  }
+  return best_index;
+}
+
+index_t bvh_t::_link(index_t node) {
+  _get(node).parent = invalid_index;
+  // special case an empty tree
+  if (_root == invalid_index) {
+    _root = node;
+    return invalid_index;
+  }
+  // find the best sibling for node, which for a grafted subtree may be any
+  // node that fits it well rather than only a leaf
+  const aabb_t &aabb = _get(node).aabb;
+  const index_t sibi = _is_leaf(node) ?
+    _find_best_sibling(aabb, _frame.update_nodes) :
+    _find_best_node(aabb, _frame.update_nodes);
+  assert(sibi != invalid_index);
+  // once the best sibling has been found we come to the insertion phase
+  const node_t &sib = _get(sibi);
+  const index_t parent = sib.parent;
+  const index_t inter = _insert_beside(sibi, node);
+  _get(inter).parent = parent;
+  // fix up parent child relationship
+  if (parent != invalid_index) {
+    node_t &p = _get(parent);
+    p.replace_child(sibi, inter);
+  }
+  else {
+    // the sibling was the root
+    _root = inter;
+  }
+  return parent;
+}
+
+void bvh_t::_insert(index_t node) {
+  // recalculate aabb and optimize on the way up
+  _recalc_aabbs(_link(node));
+}
+
+void bvh_t::remove(index_t index) {
+  assert(index != invalid_index);
+  assert(_is_leaf(index));
+  _unlink(index);
+  _free_node(index);
+#if VALIDATE
+  _validate(_root);
+#endif
+}
+
+void bvh_t::remove_batch(const std::vector<index_t> &indices) {
+  if (indices.empty()) {
+    return;
+  }
+  std::vector<uint8_t> mark(_max_nodes, mark_keep);
+  size_t count = 0;
+  for (index_t index : indices) {
+    assert(index != invalid_index);
+    assert(_is_leaf(index));
+    if (mark[index] != mark_dead) {
+      mark[index] = mark_dead;
+      ++count;
+    }
+  }
+  std::vector<index_t> freed;
+  const size_t leaves = (size() + 1) / 2;
+  if (float(count) >= float(leaves) * c_rebuild_fraction) {
+    // most of the tree is going so just build again from the survivors
+    std::vector<index_t> survivors;
+    survivors.reserve(leaves - count);
+    std::vector<index_t> stack;
+    stack.reserve(c_stack_reserve);
+    if (_root != invalid_index) {
+      stack.push_back(_root);
+    }
+    while (!stack.empty()) {
+      const index_t i = stack.back();
+      stack.pop_back();
+      const node_t &node = _get(i);
+      if (!node.is_leaf()) {
+        stack.push_back(node.child[1]);
+        stack.push_back(node.child[0]);
+        freed.push_back(i);
+      }
+      else if (mark[i] == mark_dead) {
+        freed.push_back(i);
+      }
+      else {
+        survivors.push_back(i);
+      }
+    }
+    _free_nodes(freed);
+    _root = invalid_index;
+    _rebuild(survivors);
+  }
+  else {
+    // mark every ancestor of a removed leaf, stopping at shared ones
+    for (index_t index : indices) {
+      index_t i = _get(index).parent;
+      for (; i != invalid_index && mark[i] != mark_touched; i = _get(i).parent) {
+        mark[i] = mark_touched;
+      }
+    }
+    // collapse the marked paths in one bottom up sweep
+    _root = _collapse(_root, mark, freed);
+    if (_root != invalid_index) {
+      _get(_root).parent = invalid_index;
+    }
+    _free_nodes(freed);
+  }
+#if VALIDATE
+  _validate(_root);
+#endif
+}
+
+void bvh_t::kill(index_t index) {
+  assert(_is_live_leaf(index));
+  node_t &node = _get(index);
+  assert(node.count == 1);
+  node.count = 0;
+  node.stamp = _epoch;
+  // only the live counts and keys need to change, the shape and aabbs stay
+  // as they are
+  for (index_t i = node.parent; i != invalid_index; i = _get(i).parent) {
+    node_t &n = _get(i);
+    --n.count;
+    n.stamp = _epoch;
+    _keys[i] = std::max(_live_key(n.child[0]), _live_key(n.child[1]));
+  }
+  _dead.push_back(index);
+}
+
+size_t bvh_t::cleanup(size_t budget) {
+  if (budget == 0 || budget > _dead.size()) {
+    budget = _dead.size();
+  }
+  // take from the end as recent kills are most likely still dead
+  std::vector<index_t> batch(_dead.end() - budget, _dead.end());
+  _dead.resize(_dead.size() - budget);
+  // leaves may have been removed, and even reused, since they were killed
+  std::sort(batch.begin(), batch.end());
+  batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+  batch.erase(std::remove_if(batch.begin(), batch.end(), [this](index_t i) {
+    return !_is_live_leaf(i) || _get(i).count != 0;
+  }), batch.end());
+  remove_batch(batch);
+  return batch.size();
+}
+
+index_t bvh_t::_collapse(index_t i, const std::vector<uint8_t> &mark,
+                         std::vector<index_t> &freed) {
+  switch (mark[i]) {
+  case mark_keep:
+    // nothing was removed from this subtree
+    return i;
+  case mark_dead:
+    // a removed leaf
+    freed.push_back(i);
+    return invalid_index;
+  default:
+    break;
+  }
+  node_t &node = _get(i);
+  const index_t c0 = _collapse(node.child[0], mark, freed);
+  const index_t c1 = _collapse(node.child[1], mark, freed);
+  if (c0 == invalid_index || c1 == invalid_index) {
+    // this node has at most one child left so splice it out
+    freed.push_back(i);
+    return (c0 == invalid_index) ? c1 : c0;
+  }
+  node.child[0] = c0;
+  node.child[1] = c1;
+  _get(c0).parent = i;
+  _get(c1).parent = i;
+  _refit(i);
+  return i;
+}
+
+void bvh_t::_rebuild(const std::vector<index_t> &leaves) {
+  assert(_root == invalid_index);
+  if (leaves.empty()) {
+    return;
+  }
+  aabb_t bounds = _get(leaves[0]).aabb;
+  for (index_t i : leaves) {
+    bounds = aabb_t::find_union(bounds, _get(i).aabb);
+  }
+  std::vector<morton_t> order(leaves.size());
+  for (size_t i = 0; i < leaves.size(); ++i) {
+    order[i].code = morton_code(_get(leaves[i]).aabb, bounds);
+    order[i].index = leaves[i];
+  }
+  std::sort(order.begin(), order.end());
+  _root = _build(order.data(), order.size());
+  _get(_root).parent = invalid_index;
+  _mark_built();
+}
+
+void bvh_t::rebuild() {
+  std::vector<index_t> leaves, interior;
+  _gather(_root, leaves, interior);
+  _free_nodes(interior);
+  // dead leaves are dropped rather than built into the new tree
+  auto dead = std::partition(leaves.begin(), leaves.end(),
+    [this](index_t i) { return _get(i).count != 0; });
+  if (dead != leaves.end()) {
+    _free_nodes(std::vector<index_t>(dead, leaves.end()));
+    leaves.erase(dead, leaves.end());
+  }
+  _dead.clear();
+  _root = invalid_index;
+  _rebuild(leaves);
+#if VALIDATE
+  _validate(_root);
+#endif
+}
+
+void bvh_t::_gather(index_t root, std::vector<index_t> &leaves,
+                    std::vector<index_t> &interior) const {
+  std::vector<index_t> stack;
+  stack.reserve(c_stack_reserve);
+  if (root != invalid_index) {
+    stack.push_back(root);
+  }
+  while (!stack.empty()) {
+    const index_t i = stack.back();
+    stack.pop_back();
+    const node_t &node = _get(i);
+    if (node.is_leaf()) {
+      leaves.push_back(i);
+    }
+    else {
+      interior.push_back(i);
+      stack.push_back(node.child[1]);
+      stack.push_back(node.child[0]);
+    }
+  }
+}
+
+size_t bvh_t::rebuild_degraded(float ratio) {
+  // subtrees left unchanged since the last search were fine then
+  const uint32_t since = _checked_epoch;
+  _checked_epoch = new_epoch();
+  std::vector<index_t> found;
+  if (_root != invalid_index) {
+    _find_degraded(_root, since, ratio, found);
+  }
+  for (index_t i : found) {
+    _rebuild_subtree(i);
+  }
+#if VALIDATE
+  _validate(_root);
+#endif
+  return found.size();
+}
+
+void bvh_t::_find_degraded(index_t i, uint32_t since, float ratio,
+                           std::vector<index_t> &found) {
+  const node_t &node = _get(i);
+  if (node.is_leaf() || node.stamp <= since) {
+    return;
+  }
+  if (node.count <= c_max_rebuild_leaves) {
+    _check_degraded(i, ratio, found);
+    return;
+  }
+  _find_degraded(node.child[0], since, ratio, found);
+  _find_degraded(node.child[1], since, ratio, found);
+}
+
+void bvh_t::_check_degraded(index_t i, float ratio,
+                            std::vector<index_t> &found) {
+  std::vector<index_t> leaves, interior;
+  _gather(i, leaves, interior);
+  if (leaves.size() < c_min_rebuild_leaves) {
+    return;
+  }
+  // sah cost of this subtree as it stands
+  float actual = 0.f;
+  for (index_t j : interior) {
+    actual += _get(j).aabb.area();
+  }
+  // a subtree which has not grown much since it was last measured can not
+  // have degraded, which saves trying a binned build
+  sah_ref_t &ref = _sah_refs[i];
+  if (ref.leaves == leaves.size() && actual <= ref.cost * ratio) {
+    return;
+  }
+  // otherwise find the cost it would have after a rebuild
+  aabb_t bounds;
+  std::vector<sah_leaf_t> items;
+  _sah_leaves(leaves, items);
+  const float ideal = sah_cost(items.data(), items.size(), bounds);
+  ref.cost = ideal;
+  ref.leaves = uint32_t(leaves.size());
+  if (actual > ideal * ratio) {
+    found.push_back(i);
+  }
+}
+
+void bvh_t::_rebuild_subtree(index_t i) {
+  std::vector<index_t> leaves, interior;
+  _gather(i, leaves, interior);
+  if (interior.empty()) {
+    return;
+  }
+  // the subtree root is gathered first, so it stays the root after the
+  // rebuild and the link from its parent remains valid
+  assert(interior.front() == i);
+  const index_t parent = _get(i).parent;
+  std::vector<sah_leaf_t> items;
+  _sah_leaves(leaves, items);
+  const index_t *pool = interior.data();
+  const index_t root = _build_binned(items.data(), items.size(), pool);
+  assert(root == i);
+  assert(pool == interior.data() + interior.size());
+  // the bounds are unchanged as the subtree holds the same leaves, so the
+  // ancestors only need stamping to show something below them changed
+  _get(root).parent = parent;
+  _stamp(parent);
+}
+
+void bvh_t::_mark_built() {
+  _checked_epoch = new_epoch();
+  _sah_refs.fill(sah_ref_t{ 0.f, 0 });
+}
+
+void bvh_t::_sah_leaves(const std::vector<index_t> &leaves,
+                        std::vector<sah_leaf_t> &out) const {
+  out.resize(leaves.size());
+  for (size_t i = 0; i < leaves.size(); ++i) {
+    const aabb_t &a = _get(leaves[i]).aabb;
+    out[i].aabb = a;
+    out[i].cx = (a.minx + a.maxx) * .5f;
+    out[i].cy = (a.miny + a.maxy) * .5f;
+    out[i].index = leaves[i];
+  }
+}
+
+index_t bvh_t::_build_binned(sah_leaf_t *leaves, size_t count,
+                             const index_t *&pool) {
+  assert(count > 0);
+  if (count == 1) {
+    return leaves[0].index;
+  }
+  const index_t inter = *(pool++);
+  const size_t split = sah_split(leaves, count);
+  const index_t c0 = _build_binned(leaves, split, pool);
+  const index_t c1 = _build_binned(leaves + split, count - split, pool);
+  node_t &node = _get(inter);
+  node.child[0] = c0;
+  node.child[1] = c1;
+  node.parent = invalid_index;  // fixed up by callee
+  node.user_data = nullptr;
+  _get(c0).parent = inter;
+  _get(c1).parent = inter;
+  _refit(inter);
+  return inter;
+}
+
+void bvh_t::end_frame() {
+  frame_stats_t &f = _frame;
+  f.quality = quality();
+  policy_t &p = _policy;
+
+  const float leaves = float((size() + 1) / 2);
+  const float log_n = std::max(1.f, log2f(std::max(1.f, leaves)));
+  if (p.reference_quality <= 0.f) {
+    // first frame, so seed the cost model
+    p.reference_quality = f.quality;
+    p.update_cost[0] = log_n;
+    p.update_cost[1] = log_n * 4.f;
+    p.degrade[0] = 1.f / std::max(1.f, leaves);
+    p.degrade[1] = 0.f;
+  }
+  else {
+    p.reference_quality = std::min(p.reference_quality, f.quality);
+  }
+  // relative degradation of the tree against its best known quality
+  const float d = (p.reference_quality > 0.f) ?
+    (f.quality / p.reference_quality) : 1.f;
+
+  // learn the cost of the escape handling used over this frame
+  if (f.escapes) {
+    const int m = (maintenance == maintenance_t::refit) ? 0 : 1;
+    const float k = c_policy_smoothing;
+    const float cost = float(f.update_nodes) / float(f.escapes);
+    p.update_cost[m] += (cost - p.update_cost[m]) * k;
+    const float loss = std::max(0.f, d - p.last_degradation) / float(f.escapes);
+    p.degrade[m] += (loss - p.degrade[m]) * k;
+  }
+
+  // query cost if the tree were ideal, and the overhead we pay over that
+  const float queries = float(f.query_nodes);
+  const float ideal = queries / std::max(1.f, d);
+  const float overhead = queries - ideal;
+
+  // predict the total cost of next frame for each escape handling
+  const float escapes = float(f.escapes);
+  float predict[2];
+  for (int m = 0; m < 2; ++m) {
+    predict[m] = escapes * p.update_cost[m] +
+                 ideal * (d + escapes * p.degrade[m]);
+  }
+  maintenance = (predict[0] < predict[1]) ?
+    maintenance_t::refit : maintenance_t::reinsert;
+  f.decision = maintenance;
+
+  // a rebuild wins if it pays for itself before the tree degrades again
+  const float rebuild_cost = leaves * log_n;
+  const float saving = overhead * c_rebuild_horizon;
+  if (_root != invalid_index && !_is_leaf(_root) && saving >= rebuild_cost) {
+    rebuild();
+    f.decision = maintenance_t::full_rebuild;
+    p.reference_quality = quality();
+  }
+  else if (saving >= rebuild_cost * .5f && p.cooldown == 0) {
+    // try to fix up just the regions of the tree which have degraded
+    if (rebuild_degraded(degraded_ratio)) {
+      f.decision = maintenance_t::partial_rebuild;
+    }
+    else {
+      p.cooldown = c_partial_cooldown;
+    }
+  }
+  else if (p.cooldown) {
+    --p.cooldown;
+  }
+  p.last_degradation = (p.reference_quality > 0.f) ?
+    (quality() / p.reference_quality) : 1.f;
+
+  if (auto_growth) {
+    _tune_growth(f);
+  }
+
+  // record this frame and start the next
+  if (_history.size() >= c_max_history) {
+    _history.erase(_history.begin());
+  }
+  _history.push_back(f);
+  _frame = frame_stats_t();
+#if VALIDATE
+  _validate(_root);
+#endif
+}
+
+void bvh_t::_tune_growth(const frame_stats_t &f) {
+  tuner_t &t = _tuner;
+  t.movers += f.movers;
+  t.escapes += f.escapes;
+  t.leaf_hits += f.leaf_hits;
+  t.false_positives += f.false_positives;
+  t.update_nodes += f.update_nodes;
+  t.query_nodes += f.query_nodes;
+  if (++t.frames < c_growth_frames) {
+    return;
+  }
+
+  growth_sample_t sample;
+  sample.growth = growth;
+  sample.escape_rate = t.movers ?
+    float(t.escapes) / float(t.movers) : 0.f;
+  sample.false_positive_rate = t.leaf_hits ?
+    float(t.false_positives) / float(t.leaf_hits) : 0.f;
+  sample.cost = float(t.update_nodes + t.query_nodes) / float(t.frames);
+
+  // model the escape cost as falling with 1/growth and the part of the query
+  // cost spent on the margins as rising with growth. their sum is smallest
+  // when they are equal, which is at growth * sqrt(escape / margin cost).
+  const float escape_cost = float(t.update_nodes);
+  const float margin_cost = float(t.query_nodes) * sample.false_positive_rate;
+  float scale = sqrtf((escape_cost + 1.f) / (margin_cost + 1.f));
+  scale = std::min(std::max(scale, 1.f / (1.f + c_growth_max_step)),
+                   1.f + c_growth_max_step);
+  growth = std::min(std::max(growth * scale, c_growth_min), c_growth_max);
+
+  if (_growth_history.size() >= c_max_history) {
+    _growth_history.erase(_growth_history.begin());
+  }
+  _growth_history.push_back(sample);
+  // start gathering the next sample
+  t = tuner_t();
+}
+
+void bvh_t::move(index_t index, const aabb_t &aabb) {
+  assert(index != invalid_index);
+  assert(_is_leaf(index));
+  auto &node = _get(index);
+  assert(node.count != 0);
+  ++_frame.movers;
+  if (node.asleep) {
+    wake(index);
+  }
+  node.tight = aabb;
+  // check fat aabb against slim new aabb for hysteresis on our updates
+  if (node.aabb.contains(aabb)) {
+    // this is okay and we can early exit, once the ancestors tight bounds
+    // cover the new aabb. they are grown with some slack, inside the fat
+    // aabb, so the next few small moves stop at the parent, and made exact
+    // again at the next refit.
+    const aabb_t slack = aabb_t::grow(aabb, growth * c_tight_slack);
+    _grow_tight(node.parent, aabb, aabb_t{
+      std::max(slack.minx, node.aabb.minx), std::max(slack.miny, node.aabb.miny),
+      std::min(slack.maxx, node.aabb.maxx), std::min(slack.maxy, node.aabb.maxy)});
+    _stamp(index);
+    return;
+  }
+  ++_frame.escapes;
+  if (maintenance == maintenance_t::refit) {
+    // grow the leaf in place and just refit its ancestors
+    node.aabb = aabb_t::grow(aabb, growth);
+    node.stamp = _epoch;
+    _touched_aabb(node.parent);
+#if VALIDATE
+    _validate(_root);
+#endif
+    return;
+  }
+  // effectively remove this node from the tree
+  _unlink(index);
+  // save the fat version of this aabb
+  node.aabb = aabb_t::grow(aabb, growth);
+  node.stamp = _epoch;
+  // insert into the tree
+  _insert(index);
+#if VALIDATE
+  _validate(_root);
+#endif
+}
+
+void bvh_t::move_batch(const std::vector<index_t> &indices,
+                       const std::vector<aabb_t> &aabbs) {
+  assert(indices.size() == aabbs.size());
+  for (size_t i = 0; i < indices.size(); ++i) {
+    if (!_get(indices[i]).asleep) {
+      move(indices[i], aabbs[i]);
+    }
+  }
+}
+
+void bvh_t::sleep(index_t index) {
+  assert(_is_live_leaf(index));
+  node_t &node = _get(index);
+  if (!node.asleep) {
+    node.asleep = true;
+    _propagate_sleep(node.parent);
+  }
+}
+
+void bvh_t::wake(index_t index) {
+  assert(_is_live_leaf(index));
+  node_t &node = _get(index);
+  if (node.asleep) {
+    node.asleep = false;
+    _propagate_sleep(node.parent);
+  }
+}
+
+void bvh_t::set_key(index_t index, float key) {
+  assert(_is_live_leaf(index));
+  _keys[index] = key;
+  // stop as soon as an ancestors largest key is left unchanged
+  for (index_t i = _get(index).parent; i != invalid_index;
+       i = _get(i).parent) {
+    const node_t &node = _get(i);
+    const float best =
+      std::max(_live_key(node.child[0]), _live_key(node.child[1]));
+    if (_keys[i] == best) {
+      break;
+    }
+    _keys[i] = best;
+  }
+  _stamp(index);
+#if VALIDATE
+  _validate(_root);
+#endif
+}
+
+void bvh_t::_propagate_sleep(index_t i) {
+  // stop as soon as a node is left unchanged, as its ancestors will be too
+  while (i != invalid_index) {
+    node_t &node = _get(i);
+    const bool asleep = _child(i, 0).asleep && _child(i, 1).asleep;
+    if (node.asleep == asleep) {
+      break;
+    }
+    node.asleep = asleep;
+    i = node.parent;
+  }
+}
+
+void bvh_t::insert_batch(const std::vector<aabb_t> &aabbs,
+                         const std::vector<void*> &user_data,
+                         std::vector<index_t> &out) {
+  assert(user_data.empty() || user_data.size() == aabbs.size());
+  const size_t count = aabbs.size();
+  out.resize(count);
+  if (count == 0) {
+    return;
+  }
+  // every leaf will need one interior node to link it into the tree
+  assert(size() + count * 2 <= capacity());
+  // create all of the leaves up front
+  aabb_t bounds = aabbs[0];
+  for (size_t i = 0; i < count; ++i) {
+    out[i] = _new_leaf(aabbs[i], user_data.empty() ? nullptr : user_data[i]);
+    bounds = aabb_t::find_union(bounds, aabbs[i]);
+  }
+  // sort the leaves spatially
+  std::vector<morton_t> order(count);
+  for (size_t i = 0; i < count; ++i) {
+    order[i].code = morton_code(_get(out[i]).aabb, bounds);
+    order[i].index = out[i];
+  }
+  std::sort(order.begin(), order.end());
+  _link_sorted(order.data(), count);
+}
+
+void bvh_t::_link_sorted(const morton_t *m, size_t count) {
+  if (_root == invalid_index) {
+    // nothing to graft onto so the batch becomes the tree
+    _root = _build(m, count);
+    _get(_root).parent = invalid_index;
+    _mark_built();
+  }
+  else {
+    std::vector<index_t> touched;
+    _graft(m, count, touched);
+    _recalc_aabbs(touched);
+  }
+#if VALIDATE
+  _validate(_root);
+#endif
+}
+
+bool write_boxes(const char *path, const std::vector<aabb_t> &boxes) {
+  boxes_file_t file;
+  memset(&file, 0, sizeof(file));
+  memcpy(file.magic, c_boxes_magic, sizeof(file.magic));
+  file.version = c_boxes_version;
+  file.count = boxes.size();
+  file.bounds = boxes.empty() ? aabb_t{ 0.f, 0.f, 0.f, 0.f } : boxes[0];
+  for (const aabb_t &b : boxes) {
+    file.bounds = aabb_t::find_union(file.bounds, b);
+  }
+  const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  const bool ok =
+      write_at(fd, &file, sizeof(file), 0) &&
+      write_at(fd, boxes.data(), boxes.size() * sizeof(aabb_t), sizeof(file));
+  return (::close(fd) == 0) && ok;
+}
+
+bool read_boxes(const char *path, std::vector<aabb_t> &boxes) {
+  const int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  boxes_file_t file;
+  bool ok = read_boxes_header(fd, file);
+  if (ok) {
+    boxes.resize(size_t(file.count));
+    ok = read_at(fd, boxes.data(), boxes.size() * sizeof(aabb_t),
+                 sizeof(file));
+  }
+  ::close(fd);
+  return ok;
+}
+
+bool bvh_t::load(const char *path, size_t chunk, std::vector<index_t> &out,
+                 io_mode_t mode) {
+  // enough reads in flight to cover sorting the chunk in hand
+  static const uint32_t c_depth = 4;
+  typedef std::chrono::steady_clock load_clock_t;
+  assert(chunk > 0);
+  _load = load_stats_t();
+  chunk_stream_t stream;
+  boxes_file_t file;
+  if (!stream.open(path, sizeof(file), chunk * sizeof(aabb_t), c_depth,
+                   mode == io_mode_t::io_uring) ||
+      !read_boxes_header(stream.fd, file)) {
+    return false;
+  }
+  // every leaf will need one interior node to link it into the tree, so
+  // give up before allocating anything if they would not all fit
+  if (file.count > (capacity() - size()) / 2) {
+    return false;
+  }
+  _load.io_uring = stream.use_uring;
+  const size_t count = size_t(file.count);
+  std::vector<morton_t> order(count);
+  // ends of the sorted runs in 'order', one per chunk
+  std::vector<size_t> runs(1, 0);
+  size_t done = 0;
+  const size_t first = out.size();
+  out.reserve(first + count);
+  for (;;) {
+    const load_clock_t::time_point t0 = load_clock_t::now();
+    const uint8_t *data = nullptr;
+    size_t bytes = 0;
+    const bool more = stream.next(data, bytes);
+    const load_clock_t::time_point t1 = load_clock_t::now();
+    _load.wait += std::chrono::duration<double>(t1 - t0).count();
+    if (!more) {
+      break;
+    }
+    const size_t boxes = bytes / sizeof(aabb_t);
+    if (done + boxes > count) {
+      break;
+    }
+    // build the leaves of this chunk while the next ones are being read
+    for (size_t i = 0; i < boxes; ++i) {
+      aabb_t aabb;
+      memcpy(&aabb, data + i * sizeof(aabb_t), sizeof(aabb_t));
+      morton_t &m = order[done + i];
+      m.index = _new_leaf(aabb, nullptr);
+      m.code = morton_code(aabb, file.bounds);
+      out.push_back(m.index);
+    }
+    stream.release();
+    std::sort(order.begin() + ptrdiff_t(done),
+              order.begin() + ptrdiff_t(done + boxes));
+    done += boxes;
+    runs.push_back(done);
+    ++_load.chunks;
+    _load.build +=
+        std::chrono::duration<double>(load_clock_t::now() - t1).count();
+  }
+  if (stream.failed || done != count) {
+    // give back the leaves made so far
+    _free_nodes(std::vector<index_t>(out.begin() + ptrdiff_t(first),
+                                     out.end()));
+    out.resize(first);
+    return false;
+  }
+  const load_clock_t::time_point t2 = load_clock_t::now();
+  // merge pairs of neighbouring runs until one is left
+  while (runs.size() > 2) {
+    std::vector<size_t> merged(1, 0);
+    for (size_t r = 1; r < runs.size(); r += 2) {
+      if (r + 1 < runs.size()) {
+        std::inplace_merge(order.begin() + ptrdiff_t(runs[r - 1]),
+                           order.begin() + ptrdiff_t(runs[r]),
+                           order.begin() + ptrdiff_t(runs[r + 1]));
+        merged.push_back(runs[r + 1]);
+      }
+      else {
+        merged.push_back(runs[r]);
+      }
+    }
+    runs.swap(merged);
+  }
+  if (count) {
+    _link_sorted(order.data(), count);
+  }
+  _load.boxes = count;
+  _load.build +=
+      std::chrono::duration<double>(load_clock_t::now() - t2).count();
+  return true;
+}
+
+index_t bvh_t::_build(const morton_t *m, size_t count) {
+  assert(count > 0);
+  if (count == 1) {
+    return m[0].index;
+  }
+  const size_t split = morton_split(m, count);
+  const index_t c0 = _build(m, split);
+  const index_t c1 = _build(m + split, count - split);
+  const index_t inter = _new_node();
+  node_t &node = _get(inter);
+  node.child[0] = c0;
+  node.child[1] = c1;
+  node.parent = invalid_index;  // fixed up by callee
+  node.user_data = nullptr;
+  _get(c0).parent = inter;
+  _get(c1).parent = inter;
+  _refit(inter);
+  return inter;
+}
+
+void bvh_t::_graft(const morton_t *m, size_t count,
+                   std::vector<index_t> &touched) {
+  assert(count > 0);
+  // measure how densely packed this group of leaves is. the tight boxes are
+  // used as the fat ones are padded enough to make any group look dense.
+  aabb_t bounds = _get(m[0].index).aabb;
+  aabb_t tight = _get(m[0].index).tight;
+  float area = 0.f;
+  for (size_t i = 0; i < count; ++i) {
+    const node_t &leaf = _get(m[i].index);
+    bounds = aabb_t::find_union(bounds, leaf.aabb);
+    tight = aabb_t::find_union(tight, leaf.tight);
+    area += leaf.tight.area();
+  }
+  if (count == 1 || area >= tight.area() * c_graft_density) {
+    // build a local subtree and link it into the tree in one go
+    const index_t sub = _build(m, count);
+    const index_t parent = _link(sub);
+    // keep ancestors enclosing so later searches see the new subtree
+    for (index_t i = parent; i != invalid_index; i = _get(i).parent) {
+      node_t &node = _get(i);
+      if (node.aabb.contains(bounds)) {
+        break;
+      }
+      node.aabb = aabb_t::find_union(node.aabb, bounds);
+    }
+    touched.push_back(parent);
+    return;
+  }
+  // too sparse so split the group and try again
+  const size_t split = morton_split(m, count);
+  _graft(m, split, touched);
+  _graft(m + split, count - split, touched);
+}
+
+void bvh_t::_recalc_aabbs(const std::vector<index_t> &touched) {
+  // gather every ancestor of the touched nodes exactly once
+  std::vector<std::pair<int32_t, index_t>> order;
+  std::vector<uint8_t> seen(_max_nodes, 0);
+  for (index_t t : touched) {
+    for (index_t i = t; i != invalid_index && !seen[i]; i = _get(i).parent) {
+      seen[i] = 1;
+      order.emplace_back(0, i);
+    }
+  }
+  for (auto &o : order) {
+    for (index_t i = _get(o.second).parent; i != invalid_index;
+         i = _get(i).parent) {
+      ++o.first;
+    }
+  }
+  // deepest first so that children are refit before their parents
+  std::sort(order.begin(), order.end(),
+    [](const std::pair<int32_t, index_t> &a,
+       const std::pair<int32_t, index_t> &b) {
+      return a.first > b.first;
+    });
+  for (const auto &o : order) {
+    _refit(o.second);
+    _optimize(_get(o.second));
+  }
+  _frame.update_nodes += order.size();
+}
+
+void bvh_t::_free_all() {
+  _free_list = 0;
+  for (index_t i = 0; i < _max_nodes; ++i) {
+    _get(i).child[0] = i + 1;
+    _get(i).child[1] = invalid_index;
+    _get(i).parent = invalid_index;
+    _get(i).stamp = 0;
+  }
+  // mark the end of the list of free nodes
+  _get(_max_nodes - 1).child[0] = invalid_index;
+  _get(_max_nodes - 1).child[1] = invalid_index;
+  _get(_max_nodes - 1).parent = invalid_index;
+  _root = invalid_index;
+  _num_nodes = 0;
+}
+
+index_t bvh_t::_new_node() {
+  index_t out = _free_list;
+  assert(out != invalid_index);
+  _free_list = get(_free_list).child[0];
+  ++_num_nodes;
+  return out;
+}
+
+void bvh_t::_unlink(index_t index) {
+  // assume we only ever unlink a leaf
+  assert(_is_leaf(index));
+  auto &node = _get(index);
+
+  // special case root node
+  if (index == _root) {
+    assert(node.parent == invalid_index);
+    // case 1 (node was root)
+    _root = invalid_index;
+    return;
+  }
+
+  auto &p0 = _get(node.parent);
+
+  if (p0.parent == invalid_index) {
+
+    // case 2 (p0 is root)
+    //       P0
+    //  node     ?
+
+    // find the sibling node
+    index_t sib = (p0.child[0] == index) ? 1 : 0;
+    // promote as the new root
+    _root = p0.child[sib];
+    _get(_root).parent = invalid_index;
+    // free p0 node
+    _free_node(node.parent);
+    node.parent = invalid_index;
+    return;
+  }
+
+  auto &p1 = _get(p0.parent);
+
+  // case 3 (p0 is not root)
+  //              p1
+  //       p0
+  //  node     ?
+
+  // find the configuration of p1 children
+  // find child index of p0 for p1
+  index_t p1c = (p1.child[0] == node.parent) ? 0 : 1;
+  assert(p1.child[p1c] == node.parent);
+
+  // find the configuration of p0 children
+  // find child index of 'node' for p0
+  index_t p0c = (p0.child[0] == index) ? 0 : 1;
+  assert(p0.child[p0c] == index);
+
+  // promote sibling of 'node' into place of p0
+  // find sibling of 'node'
+  index_t sib = p0.child[p0c ^ 1];
+  assert(sib != invalid_index);
+  // promote sibling of 'node' into place of p0
+  p1.child[p1c] = sib;
+  _get(sib).parent = p0.parent;
+
+  // recalculate the remaining tree aabbs, p1 up
+  _touched_aabb(p0.parent);
+
+  // free p0
+  _free_node(node.parent);
+  // node is now unlinked
+  node.parent = invalid_index;
+}
+
+void bvh_t::_touched_aabb(index_t i) {
+  while (i != invalid_index) {
+    node_t &node = _get(i);
+    assert(!node.is_leaf());
+    assert(node.child[0] != invalid_index);
+    assert(node.child[1] != invalid_index);
+    _refit(i);
+    ++_frame.update_nodes;
+    i = node.parent;
+  }
+}
+
+void bvh_t::_grow_tight(index_t i, const aabb_t &aabb, const aabb_t &slack) {
+  // each tight bound covers those below it, so stop at the first which
+  // already covers this aabb, or the slack once a node below has grown
+  const aabb_t *cover = &aabb;
+  for (; i != invalid_index; i = _get(i).parent) {
+    node_t &node = _get(i);
+    if (node.tight.contains(*cover)) {
+      break;
+    }
+    node.tight = aabb_t::find_union(node.tight, slack);
+    cover = &slack;
+  }
+}
+
+void bvh_t::_stamp(index_t i) {
+  // ancestors of a node stamped this epoch will have been stamped too
+  while (i != invalid_index) {
+    node_t &node = _get(i);
+    if (node.stamp == _epoch) {
+      break;
+    }
+    node.stamp = _epoch;
+    i = node.parent;
+  }
+}
+
+void bvh_t::_free_node(index_t index) {
+  assert(index != invalid_index);
+  auto &node = _get(index);
+  node.child[0] = _free_list;
+  node.child[1] = invalid_index;
+  node.parent = invalid_index;
+  node.stamp = _epoch;
+  _free_list = index;
+  assert(_num_nodes > 0);
+  --_num_nodes;
+}
+
+void bvh_t::_free_nodes(const std::vector<index_t> &indices) {
+  if (indices.empty()) {
+    return;
+  }
+  // chain the nodes together and splice them onto the free list
+  for (size_t i = 0; i < indices.size(); ++i) {
+    node_t &node = _get(indices[i]);
+    node.child[0] = (i + 1 < indices.size()) ? indices[i + 1] : _free_list;
+    node.child[1] = invalid_index;
+    node.parent = invalid_index;
+    node.stamp = _epoch;
+  }
+  _free_list = indices.front();
+  assert(_num_nodes >= index_t(indices.size()));
+  _num_nodes -= index_t(indices.size());
+}
+
+void bvh_t::_validate(index_t index) {
+  if (index == invalid_index) {
+    return;
+  }
+
+  auto &node = _get(index);
+
+  if (index == _root) {
+    assert(_get(index).parent == invalid_index);
+  }
+  // check parents children
+  if (node.parent != invalid_index) {
+    auto &parent = _get(node.parent);
+    assert(parent.child[0] != parent.child[1]);
+    assert(parent.child[0] == index ||
+           parent.child[1] == index);
+  }
+  if (_is_leaf(index)) {
+    // leaves should have no children
+    assert(node.child[0] == invalid_index);
+    assert(node.child[1] == invalid_index);
+    // and are either live or dead
+    assert(node.count <= 1);
+    // with the users aabb inside the fat one
+    assert(node.aabb.contains(node.tight));
+  }
+  else {
+    // interior nodes should have two children
+    assert(node.child[0] != invalid_index);
+    assert(node.child[1] != invalid_index);
+    // validate childrens parent indices
+    assert(_child(index, 0).parent == index);
+    assert(_child(index, 1).parent == index);
+    // stamps must cover everything below
+    assert(node.stamp >= _child(index, 0).stamp);
+    assert(node.stamp >= _child(index, 1).stamp);
+    // as must the leaf count and sleep flag
+    assert(node.count == _child(index, 0).count + _child(index, 1).count);
+    assert(node.asleep ==
+           (_child(index, 0).asleep && _child(index, 1).asleep));
+    assert(_keys[index] ==
+           std::max(_live_key(node.child[0]), _live_key(node.child[1])));
+    // validate aabbs
+    assert(node.aabb.contains(_child(index, 0).aabb));
+    assert(node.aabb.contains(_child(index, 1).aabb));
+    assert(node.tight.contains(_child(index, 0).tight));
+    assert(node.tight.contains(_child(index, 1).tight));
+    // validate child nodes
+    _validate(node.child[0]);
+    _validate(node.child[1]);
+
+    // XXX: check area of aabb is minimal?
+  }
+}
+
+void bvh_t::_optimize(node_t &node) {
+
+#if VALIDATE
+  const float before = quality();
+#endif
+
+  // four possible rotations
+  //
+  //        n                   n
+  //   c0       c1         c0      *x0
+  // x0  x1             *c1  x1
+  //
+  //        n                   n
+  //   c0       c1         c0      *x1
+  // x0  x1              x0 *c1
+  //
+  // same as above but with c0 and c1 roles swapped
+
+  for (int i = 0; i < 2; ++i) {
+
+    // gen 1
+    const auto c0i = node.child[0];
+    const auto c1i = node.child[1];
+    if (c0i == invalid_index || c1i == invalid_index) {
+      return;
+    }
+    auto &c0 = _get(c0i);
+    auto &c1 = _get(c1i);
+
+    // gen 2
+    const auto x0i = c0.child[0];
+    const auto x1i = c0.child[1];
+    if (x0i == invalid_index || x1i == invalid_index) {
+      // swap c0 and c1 and try again (rotations 3 and 4)
+      std::swap(node.child[0], node.child[1]);
+      continue;
+    }
+    auto &x0 = _get(x0i);
+    auto &x1 = _get(x1i);
+
+    // note: this heuristic only looks at minimizing the area of c0
+    //       which is all that is affected by these rotations
+
+    // current
+    const float h0 = c0.aabb.area();
+    // rotation 1
+    const aabb_t a1 = aabb_t::find_union(c1.aabb, x1.aabb);
+    const float h1 = a1.area();
+    // rotation 2
+    const aabb_t a2 = aabb_t::find_union(x0.aabb, c1.aabb);
+    const float h2 = a2.area();
+
+    if (h1 < h2) {
+      if (h1 < h0) {
+        // do rotation 1 (swap x0/c1)
+        //        n                   n
+        //   c0       c1  ->     c0      *x0
+        // x0  x1             *c1  x1
+        //
+        c1.parent = c0i;
+        x0.parent = c0.parent;
+        std::swap(c0.child[0], node.child[1]); // x0 and c1
+        _refit(c0i);
+        assert(c0.aabb.contains(c1.aabb));
+        assert(c0.aabb.contains(x1.aabb));
+      }
+    } else {
+      if (h2 < h0) {
+        // do rotation 2 (swap x1/c1)
+        //        n                   n
+        //   c0       c1  ->     c0      *x1
+        // x0  x1              x0 *c1
+        //
+        c1.parent = c0i;
+        x1.parent = c0.parent;
+        std::swap(c0.child[1], node.child[1]); // x1 and c1
+        _refit(c0i);
+        assert(c0.aabb.contains(x0.aabb));
+        assert(c0.aabb.contains(c1.aabb));
+      }
+    }
+    // swap c0 and c1 and try again (rotations 3 and 4)
+    std::swap(node.child[0], node.child[1]);
+  }
+
+#if VALIDATE
+  const float after = quality();
+  assert(after - 1.f <= before);
+#endif
+}
+
+void bvh_t::find_overlaps(const aabb_t &bb, std::vector<index_t> &overlaps) {
+  _find_overlaps(bb, overlaps, _frame);
+}
+
+void bvh_t::_find_overlaps(const aabb_t &bb, std::vector<index_t> &overlaps,
+                           frame_stats_t &stats) const {
+  ++stats.queries;
+  std::vector<index_t> stack;
+  stack.reserve(c_stack_reserve);
+  if (_root != invalid_index) {
+    stack.push_back(_root);
+  }
+  while (!stack.empty()) {
+    // pop one node
+    const index_t ni = stack.back();
+    assert(ni != invalid_index);
+    const node_t &n = _get(ni);
+    ++stats.query_nodes;
+
+    // interior nodes are culled on their tight bound while leaves are
+    // tested fat and then tight so that margin hits are counted
+    if (n.count != 0 &&
+        aabb_t::overlaps(bb, n.is_leaf() ? n.aabb : n.tight)) {
+      if (n.is_leaf()) {
+        ++stats.leaf_hits;
+        if (!aabb_t::overlaps(bb, n.tight)) {
+          ++stats.false_positives;
+        }
+        else {
+          overlaps.push_back(ni);
+        }
+      }
+      else {
+        assert(n.child[0] != invalid_index);
+        assert(n.child[1] != invalid_index);
+        stack.back() = n.child[0];
+        stack.push_back(n.child[1]);
+        continue;
+      }
+    }
+    // pop node from the stack
+    stack.resize(stack.size() - 1);
+  }
+}
+
+void bvh_t::_sample_frontier(const aabb_t &bb, std::vector<index_t> &frontier,
+                             std::vector<uint64_t> &prefix) {
+  ++_frame.queries;
+  uint64_t total = 0;
+  std::vector<index_t> stack;
+  stack.reserve(c_stack_reserve);
+  if (_root != invalid_index) {
+    stack.push_back(_root);
+  }
+  while (!stack.empty()) {
+    const index_t ni = stack.back();
+    stack.pop_back();
+    const node_t &n = _get(ni);
+    ++_frame.query_nodes;
+    if (n.count == 0 || !aabb_t::overlaps(bb, n.tight)) {
+      continue;
+    }
+    // every leaf below a contained node overlaps the box
+    if (n.is_leaf() || bb.contains(n.tight)) {
+      total += n.count;
+      frontier.push_back(ni);
+      prefix.push_back(total);
+      continue;
+    }
+    stack.push_back(n.child[1]);
+    stack.push_back(n.child[0]);
+  }
+}
+
+void bvh_t::find_overlaps_batch(const std::vector<aabb_t> &boxes,
+                                std::vector<std::vector<index_t>> &results,
+                                uint32_t threads) {
+  results.resize(boxes.size());
+  threads = thread_count(threads);
+  // each query is traversed by one thread into its own result, and the
+  // stats are sums, so the output does not depend on the scheduling
+  std::vector<frame_stats_t> stats(threads);
+  parallel_for(boxes.size(), threads, [&](uint32_t t, size_t i) {
+    results[i].clear();
+    _find_overlaps(boxes[i], results[i], stats[t]);
+  });
+  for (const frame_stats_t &f : stats) {
+    _merge_query_stats(f);
+  }
+}
+
+void bvh_t::find_pairs(std::vector<std::pair<index_t, index_t>> &pairs,
+                       uint32_t threads) {
+  pairs.clear();
+  if (_root == invalid_index) {
+    return;
+  }
+  // split the tree into tasks to a fixed depth so that the tasks, and the
+  // order they are stitched back together in, only depend on the tree
+  std::vector<pair_task_t> tasks;
+  _pair_tasks(_root, _root, c_pair_task_depth, tasks);
+
+  threads = thread_count(threads);
+  std::vector<std::vector<std::pair<index_t, index_t>>> out(tasks.size());
+  std::vector<frame_stats_t> stats(threads);
+  parallel_for(tasks.size(), threads, [&](uint32_t t, size_t i) {
+    _find_pairs(tasks[i], out[i], stats[t]);
+  });
+  for (const frame_stats_t &f : stats) {
+    _merge_query_stats(f);
+  }
+  // stitch the task outputs together in task order
+  size_t total = 0;
+  for (const auto &o : out) {
+    total += o.size();
+  }
+  pairs.reserve(total);
+  for (const auto &o : out) {
+    pairs.insert(pairs.end(), o.begin(), o.end());
+  }
+}
+
+void bvh_t::_pair_tasks(index_t a, index_t b, uint32_t depth,
+                        std::vector<pair_task_t> &tasks) const {
+  const node_t &na = _get(a);
+  const node_t &nb = _get(b);
+  if (a == b) {
+    if (na.asleep || na.count < 2) {
+      return;
+    }
+    if (depth == 0 || na.is_leaf()) {
+      tasks.push_back(pair_task_t{a, b});
+      return;
+    }
+    _pair_tasks(na.child[0], na.child[0], depth - 1, tasks);
+    _pair_tasks(na.child[1], na.child[1], depth - 1, tasks);
+    _pair_tasks(na.child[0], na.child[1], depth - 1, tasks);
+    return;
+  }
+  if ((na.asleep && nb.asleep) || na.count == 0 || nb.count == 0 ||
+      !aabb_t::overlaps(na.aabb, nb.aabb)) {
+    return;
+  }
+  if (depth == 0 || (na.is_leaf() && nb.is_leaf())) {
+    tasks.push_back(pair_task_t{a, b});
+    return;
+  }
+  // descend into the larger of the two
+  if (na.is_leaf() || (!nb.is_leaf() && nb.aabb.area() > na.aabb.area())) {
+    _pair_tasks(a, nb.child[0], depth - 1, tasks);
+    _pair_tasks(a, nb.child[1], depth - 1, tasks);
+  }
+  else {
+    _pair_tasks(na.child[0], b, depth - 1, tasks);
+    _pair_tasks(na.child[1], b, depth - 1, tasks);
+  }
+}
+
+void bvh_t::_find_pairs(const pair_task_t &task,
+                        std::vector<std::pair<index_t, index_t>> &pairs,
+                        frame_stats_t &stats) const {
+  ++stats.queries;
+  std::vector<pair_task_t> stack;
+  stack.reserve(c_stack_reserve);
+  stack.push_back(task);
+  while (!stack.empty()) {
+    const pair_task_t p = stack.back();
+    stack.pop_back();
+    const node_t &na = _get(p.a);
+    const node_t &nb = _get(p.b);
+    ++stats.query_nodes;
+    if (p.a == p.b) {
+      // all pairs within one subtree
+      if (!na.is_leaf() && !na.asleep && na.count >= 2) {
+        stack.push_back(pair_task_t{na.child[0], na.child[1]});
+        stack.push_back(pair_task_t{na.child[1], na.child[1]});
+        stack.push_back(pair_task_t{na.child[0], na.child[0]});
+      }
+      continue;
+    }
+    // nothing has moved between two sleeping subtrees
+    if ((na.asleep && nb.asleep) || na.count == 0 || nb.count == 0 ||
+        !aabb_t::overlaps(na.aabb, nb.aabb)) {
+      continue;
+    }
+    if (na.is_leaf() && nb.is_leaf()) {
+      ++stats.leaf_hits;
+      if (!aabb_t::overlaps(na.tight, nb.tight)) {
+        ++stats.false_positives;
+      }
+      pairs.emplace_back(std::min(p.a, p.b), std::max(p.a, p.b));
+      continue;
+    }
+    // descend into the larger of the two
+    if (na.is_leaf() || (!nb.is_leaf() && nb.aabb.area() > na.aabb.area())) {
+      stack.push_back(pair_task_t{p.a, nb.child[1]});
+      stack.push_back(pair_task_t{p.a, nb.child[0]});
+    }
+    else {
+      stack.push_back(pair_task_t{na.child[1], p.b});
+      stack.push_back(pair_task_t{na.child[0], p.b});
+    }
+  }
+}
+
+void bvh_t::_merge_query_stats(const frame_stats_t &f) {
+  _frame.queries += f.queries;
+  _frame.query_nodes += f.query_nodes;
+  _frame.leaf_hits += f.leaf_hits;
+  _frame.false_positives += f.false_positives;
+}
+
+void bvh_t::find_overlaps_delta(uint32_t query, const aabb_t &bb,
+                                std::vector<index_t> &added,
+                                std::vector<index_t> &removed) {
+  added.clear();
+  removed.clear();
+  delta_query_t &q = _queries[query];
+  std::vector<index_t> result;
+
+  const bool same = q.epoch != 0 &&
+    bb.minx == q.bb.minx && bb.miny == q.bb.miny &&
+    bb.maxx == q.bb.maxx && bb.maxy == q.bb.maxy;
+
+  if (!same) {
+    // the query moved so it has to be run again in full
+    find_overlaps(bb, result);
+    std::sort(result.begin(), result.end());
+    std::set_difference(result.begin(), result.end(),
+                        q.result.begin(), q.result.end(),
+                        std::back_inserter(added));
+    std::set_difference(q.result.begin(), q.result.end(),
+                        result.begin(), result.end(),
+                        std::back_inserter(removed));
+  }
+  else {
+    ++_frame.queries;
+    // only leaves stamped since the last run can have changed membership,
+    // and their ancestors are all stamped too
+    std::vector<index_t> stack;
+    stack.reserve(c_stack_reserve);
+    if (_root != invalid_index) {
+      stack.push_back(_root);
+    }
+    while (!stack.empty()) {
+      const index_t ni = stack.back();
+      stack.pop_back();
+      const node_t &n = _get(ni);
+      ++_frame.query_nodes;
+      if (n.stamp <= q.epoch || n.count == 0 ||
+          !aabb_t::overlaps(bb, n.tight)) {
+        continue;
+      }
+      if (n.is_leaf()) {
+        if (!std::binary_search(q.result.begin(), q.result.end(), ni)) {
+          added.push_back(ni);
+        }
+      }
+      else {
+        stack.push_back(n.child[0]);
+        stack.push_back(n.child[1]);
+      }
+    }
+    std::sort(added.begin(), added.end());
+    // previous results which have since changed may have left
+    for (index_t i : q.result) {
+      const node_t &n = _get(i);
+      if (n.stamp > q.epoch &&
+          (!_is_live_leaf(i) || n.count == 0 ||
+           !aabb_t::overlaps(bb, n.tight))) {
+        removed.push_back(i);
+      }
+    }
+    // apply the changes to the previous results
+    std::set_difference(q.result.begin(), q.result.end(),
+                        removed.begin(), removed.end(),
+                        std::back_inserter(result));
+    const size_t mid = result.size();
+    result.insert(result.end(), added.begin(), added.end());
+    std::inplace_merge(result.begin(), result.begin() + mid, result.end());
+  }
+  // anything changed after this point will have a newer stamp
+  q.bb = bb;
+  q.epoch = _epoch++;
+  q.result.swap(result);
+}
+
+void bvh_t::release_query(uint32_t query) {
+  _queries.erase(query);
+}
+
+void bvh_t::rasterize(const aabb_t &area, float *grid,
+                      int32_t w, int32_t h) const {
+  _rasterize(area, grid, w, h, 0, h);
+}
+
+void bvh_t::rasterize(const aabb_t &area, float *grid,
+                      int32_t w, int32_t h, uint32_t threads) const {
+  threads = std::min<uint32_t>(thread_count(threads), std::max(h, 1));
+  if (threads <= 1) {
+    _rasterize(area, grid, w, h, 0, h);
+    return;
+  }
+  // each thread owns a band of rows so no cell is written by two threads
+  std::vector<std::thread> workers;
+  workers.reserve(threads);
+  for (uint32_t t = 0; t < threads; ++t) {
+    const int32_t row0 = int32_t(int64_t(h) * t / threads);
+    const int32_t row1 = int32_t(int64_t(h) * (t + 1) / threads);
+    workers.emplace_back([=]() {
+      _rasterize(area, grid, w, h, row0, row1);
+    });
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
+void bvh_t::_rasterize(const aabb_t &area, float *grid, int32_t w, int32_t h,
+                       int32_t row0, int32_t row1) const {
+  if (_root == invalid_index || w <= 0 || h <= 0 || row0 >= row1) {
+    return;
+  }
+  const float cw = (area.maxx - area.minx) / float(w);
+  const float ch = (area.maxy - area.miny) / float(h);
+  // the part of the world covered by these rows
+  const aabb_t band = { area.minx, area.miny + ch * float(row0),
+                        area.maxx, area.miny + ch * float(row1) };
+  // cell column or row containing a world coordinate
+  auto cell_x = [&](float x) { return int32_t(floorf((x - area.minx) / cw)); };
+  auto cell_y = [&](float y) { return int32_t(floorf((y - area.miny) / ch)); };
+
+  std::vector<index_t> stack;
+  stack.reserve(c_stack_reserve);
+  stack.push_back(_root);
+  while (!stack.empty()) {
+    const index_t ni = stack.back();
+    stack.pop_back();
+    const node_t &n = _get(ni);
+    if (n.count == 0 || !aabb_t::overlaps(band, n.tight)) {
+      continue;
+    }
+    const aabb_t &a = n.tight;
+    if (!n.is_leaf()) {
+      const float nw = a.maxx - a.minx;
+      const float nh = a.maxy - a.miny;
+      if (nw > cw || nh > ch) {
+        stack.push_back(n.child[1]);
+        stack.push_back(n.child[0]);
+        continue;
+      }
+      // smaller than a cell so splat all of its leaves at its center
+      const int32_t x = cell_x((a.minx + a.maxx) * .5f);
+      const int32_t y = cell_y((a.miny + a.maxy) * .5f);
+      if (x >= 0 && x < w && y >= row0 && y < row1) {
+        grid[x + y * w] += float(n.count);
+      }
+      continue;
+    }
+    // splat the leaf over every cell it overlaps
+    const int32_t x0 = std::max(cell_x(a.minx), 0);
+    const int32_t x1 = std::min(cell_x(a.maxx), w - 1);
+    const int32_t y0 = std::max(cell_y(a.miny), row0);
+    const int32_t y1 = std::min(cell_y(a.maxy), row1 - 1);
+    for (int32_t y = y0; y <= y1 && x0 <= x1; ++y) {
+      add_row(grid + x0 + y * w, x1 - x0 + 1, 1.f);
+    }
+  }
+}
+
+void bvh_t::find_top_k(const aabb_t &bb, size_t k,
+                       std::vector<index_t> &out) {
+  ++_frame.queries;
+  struct entry_t {
+    float key;
+    index_t index;
+    // set for a leaf already known to overlap the box
+    bool leaf;
+
+    // ordering for a max heap, taking leaves first so ties end the walk
+    bool operator < (const entry_t &rhs) const {
+      if (key != rhs.key) return key < rhs.key;
+      if (leaf != rhs.leaf) return !leaf;
+      return index > rhs.index;
+    }
+  };
+  std::vector<entry_t> heap;
+  heap.reserve(c_stack_reserve);
+  // queue a node if anything alive below it overlaps the box
+  auto push = [&](index_t i) {
+    const node_t &n = _get(i);
+    if (n.count == 0) {
+      return;
+    }
+    if (n.is_leaf()) {
+      if (!aabb_t::overlaps(bb, n.aabb)) {
+        return;
+      }
+      ++_frame.leaf_hits;
+      if (!aabb_t::overlaps(bb, n.tight)) {
+        ++_frame.false_positives;
+        return;
+      }
+    }
+    else if (!aabb_t::overlaps(bb, n.tight)) {
+      return;
+    }
+    heap.push_back(entry_t{ _keys[i], i, n.is_leaf() });
+    std::push_heap(heap.begin(), heap.end());
+  };
+  if (_root == invalid_index || k == 0) {
+    return;
+  }
+  push(_root);
+  size_t found = 0;
+  while (!heap.empty() && found < k) {
+    std::pop_heap(heap.begin(), heap.end());
+    const entry_t e = heap.back();
+    heap.pop_back();
+    ++_frame.query_nodes;
+    // nothing left in the queue can beat a leaf at the front
+    if (e.leaf) {
+      out.push_back(e.index);
+      ++found;
+      continue;
+    }
+    const node_t &n = _get(e.index);
+    push(n.child[0]);
+    push(n.child[1]);
+  }
+}
+
+void bvh_t::find_overlaps(index_t node, std::vector<index_t> &overlaps) {
+  const node_t &n = _get(node);
+  find_overlaps(n.tight, overlaps);
+}
 
 void bvh_t::raycast(float x0, float y0, float x1, float y1,
                     std::vector<index_t> &overlaps) {
+  ++_frame.queries;
+  std::vector<index_t> stack;
+  stack.reserve(c_stack_reserve);
+  if (_root != invalid_index) {
+    stack.push_back(_root);
+  }
+  while (!stack.empty()) {
+    // pop one node
+    const index_t ni = stack.back();
+    assert(ni != invalid_index);
+    const node_t &n = _get(ni);
+    ++_frame.query_nodes;
+    // if the ray hits the node and there is anything alive below
+    if (n.count != 0 &&
+        ::raycast(x0, y0, x1, y1, n.is_leaf() ? n.aabb : n.tight)) {
+      if (n.is_leaf()) {
+        ++_frame.leaf_hits;
+        if (!::raycast(x0, y0, x1, y1, n.tight)) {
+          ++_frame.false_positives;
+        }
+        else {
+          overlaps.push_back(ni);
+        }
+      }
+      else {
+        assert(n.child[0] != invalid_index);
+        assert(n.child[1] != invalid_index);
+        stack.back() = n.child[0];
+        stack.push_back(n.child[1]);
+        continue;
+      }
+    }
+    // pop node
+    stack.resize(stack.size() - 1);
+  }
+}
+
+void bvh_t::raycast_batch(const std::vector<ray_t> &rays,
+                          std::vector<std::vector<index_t>> &results) {
+  results.resize(rays.size());
+  for (auto &r : results) {
+    r.clear();
+  }
+  _frame.queries += uint32_t(rays.size());
+  if (rays.empty() || _root == invalid_index) {
+    return;
+  }
+  // sort the rays by origin and then direction so each packet is coherent
+  aabb_t bounds = { rays[0].x0, rays[0].y0, rays[0].x0, rays[0].y0 };
+  for (const ray_t &r : rays) {
+    bounds = aabb_t::find_union(bounds, aabb_t{ r.x0, r.y0, r.x0, r.y0 });
+  }
+  std::vector<morton_t> order(rays.size());
+  for (size_t i = 0; i < rays.size(); ++i) {
+    const ray_t &r = rays[i];
+    const uint32_t cell =
+      morton_spread(quantize(r.x0, bounds.minx, bounds.maxx) >> 6) |
+      (morton_spread(quantize(r.y0, bounds.miny, bounds.maxy) >> 6) << 1);
+    // direction as a fraction of a turn
+    const float turn = atan2f(r.y1 - r.y0, r.x1 - r.x0) * c_inv_tau + .5f;
+    const uint32_t dir = uint32_t(turn * float(1u << c_ray_dir_bits));
+    // direction first so that rays in a packet are close to parallel
+    order[i].code = (std::min(dir, (1u << c_ray_dir_bits) - 1) << 20) | cell;
+    order[i].index = index_t(i);
+  }
+  std::sort(order.begin(), order.end());
+
+  // trace each packet with a mask of the rays still active at each node
+  struct entry_t {
+    index_t node;
+    uint32_t mask;
+  };
+  std::vector<entry_t> stack;
+  stack.reserve(c_stack_reserve);
+  packet_t packet;
+  for (size_t base = 0; base < order.size(); base += c_ray_packet) {
+    const uint32_t count =
+      uint32_t(std::min<size_t>(c_ray_packet, order.size() - base));
+    for (uint32_t j = 0; j < count; ++j) {
+      const ray_t &r = rays[order[base + j].index];
+      packet.set(j, segment_t(r.x0, r.y0, r.x1, r.y1));
+    }
+    const uint32_t all = (count == 32u) ? ~0u : ((1u << count) - 1);
+    stack.push_back(entry_t{ _root, all });
+    while (!stack.empty()) {
+      const entry_t e = stack.back();
+      stack.pop_back();
+      const node_t &n = _get(e.node);
+      ++_frame.query_nodes;
+      if (n.count == 0) {
+        continue;
+      }
+      const uint32_t hit =
+        packet.hits(n.is_leaf() ? n.aabb : n.tight, e.mask);
+      if (!hit) {
+        continue;
+      }
+      if (n.is_leaf()) {
+        const uint32_t tight = packet.hits(n.tight, hit);
+        // scatter the hit back to the rays original slot
+        for (uint32_t j = 0; j < count; ++j) {
+          if (!(hit & (1u << j))) {
+            continue;
+          }
+          ++_frame.leaf_hits;
+          if (!(tight & (1u << j))) {
+            ++_frame.false_positives;
+          }
+          else {
+            results[order[base + j].index].push_back(e.node);
+          }
+        }
+      }
+      else {
+        // same visiting order as raycast()
+        stack.push_back(entry_t{ n.child[0], hit });
+        stack.push_back(entry_t{ n.child[1], hit });
+      }
+    }
+  }
+}
+
+void bvh_t::find_in_sector(const sector_t &sector,
+                           std::vector<index_t> &overlaps) {
+  ++_frame.queries;
+  const wedge_t wedge(sector);
   std::vector<index_t> stack;
-  stack.reserve(128);
+  stack.reserve(c_stack_reserve);
   if (_root != invalid_index) {
     stack.push_back(_root);
   }
   while (!stack.empty()) {
-    // pop one node
-    const index_t ni = stack.back();
-    assert(ni != invalid_index);
-    const node_t &n = _get(ni);
-    // if the ray and aabb overlap
-    if (::raycast(x0, y0, x1, y1, n.aabb)) {
-      if (n.is_leaf()) {
-        overlaps.push_back(ni);
+    const index_t ni = stack.back();
+    stack.pop_back();
+    const node_t &n = _get(ni);
+    ++_frame.query_nodes;
+    if (n.count == 0 || !wedge.maybe(n.is_leaf() ? n.aabb : n.tight)) {
+      continue;
+    }
+    if (n.is_leaf()) {
+      ++_frame.leaf_hits;
+      if (!wedge.hits(n.tight)) {
+        ++_frame.false_positives;
+      }
+      else {
+        overlaps.push_back(ni);
+      }
+    }
+    else {
+      stack.push_back(n.child[0]);
+      stack.push_back(n.child[1]);
+    }
+  }
+}
+
+void bvh_t::find_in_sector_batch(const std::vector<sector_t> &sectors,
+                                 std::vector<std::vector<index_t>> &results) {
+  results.resize(sectors.size());
+  for (auto &r : results) {
+    r.clear();
+  }
+  _frame.queries += uint32_t(sectors.size());
+  if (sectors.empty() || _root == invalid_index) {
+    return;
+  }
+  // sort the sectors by apex so each packet covers a small region
+  aabb_t bounds = { sectors[0].x, sectors[0].y, sectors[0].x, sectors[0].y };
+  for (const sector_t &s : sectors) {
+    bounds = aabb_t::find_union(bounds, aabb_t{ s.x, s.y, s.x, s.y });
+  }
+  std::vector<morton_t> order(sectors.size());
+  for (size_t i = 0; i < sectors.size(); ++i) {
+    const sector_t &s = sectors[i];
+    order[i].code = morton_code(aabb_t{ s.x, s.y, s.x, s.y }, bounds);
+    order[i].index = index_t(i);
+  }
+  std::sort(order.begin(), order.end());
+
+  // walk the tree once per packet with a mask of the sectors still active
+  struct entry_t {
+    index_t node;
+    uint32_t mask;
+  };
+  std::vector<entry_t> stack;
+  stack.reserve(c_stack_reserve);
+  wedge_t wedges[c_sector_packet];
+  wedge_packet_t packet;
+  for (size_t base = 0; base < order.size(); base += c_sector_packet) {
+    const uint32_t count =
+      uint32_t(std::min<size_t>(c_sector_packet, order.size() - base));
+    // bounds of the whole packet, to cull nodes before testing each sector
+    aabb_t reach = {};
+    for (uint32_t j = 0; j < count; ++j) {
+      const sector_t &s = sectors[order[base + j].index];
+      wedges[j] = wedge_t(s);
+      packet.set(j, wedges[j]);
+      const aabb_t r = { s.x - s.radius, s.y - s.radius,
+                         s.x + s.radius, s.y + s.radius };
+      reach = (j == 0) ? r : aabb_t::find_union(reach, r);
+    }
+    const uint32_t all = (count == 32u) ? ~0u : ((1u << count) - 1);
+    stack.push_back(entry_t{ _root, all });
+    while (!stack.empty()) {
+      const entry_t e = stack.back();
+      stack.pop_back();
+      const node_t &n = _get(e.node);
+      ++_frame.query_nodes;
+      const aabb_t &bb = n.is_leaf() ? n.aabb : n.tight;
+      if (n.count == 0 || !aabb_t::overlaps(reach, bb)) {
+        continue;
+      }
+      const uint32_t hit = packet.maybe(bb, e.mask);
+      if (!hit) {
+        continue;
+      }
+      if (n.is_leaf()) {
+        for (uint32_t j = 0; j < count; ++j) {
+          if (!(hit & (1u << j))) {
+            continue;
+          }
+          ++_frame.leaf_hits;
+          if (!wedges[j].hits(n.tight)) {
+            ++_frame.false_positives;
+          }
+          else {
+            results[order[base + j].index].push_back(e.node);
+          }
+        }
+      }
+      else {
+        // same visiting order as find_in_sector()
+        stack.push_back(entry_t{ n.child[0], hit });
+        stack.push_back(entry_t{ n.child[1], hit });
+      }
+    }
+  }
+}
+
+packed_bvh_t::packed_bvh_t()
+  : _root(0)
+  , _root_bounds{ 0.f, 0.f, 0.f, 0.f }
+  , _empty(true)
+{
+}
+
+void packed_bvh_t::build(const bvh_t &tree) {
+  _nodes.clear();
+  _leaves.clear();
+  _empty = tree.empty() || tree.root().count == 0;
+  if (!_empty) {
+    _nodes.reserve(tree.root().count - 1);
+    _leaves.reserve(tree.root().count);
+    _root = _pack(tree, tree.root_index(), -1);
+    _root_bounds = _bounds(tree, _root);
+  }
+}
+
+int32_t packed_bvh_t::_pack(const bvh_t &tree, index_t i, int32_t parent) {
+  const node_t &n = tree.get(i);
+  if (n.is_leaf()) {
+    _leaves.push_back(packed_leaf_t{ i, parent, n.user_data });
+    return ~int32_t(_leaves.size() - 1);
+  }
+  // splice out interior nodes left with only one live side
+  if (tree.get(n.child[0]).count == 0) {
+    return _pack(tree, n.child[1], parent);
+  }
+  if (tree.get(n.child[1]).count == 0) {
+    return _pack(tree, n.child[0], parent);
+  }
+  const int32_t self = int32_t(_nodes.size());
+  _nodes.emplace_back();
+  for (int c = 0; c < 2; ++c) {
+    const int32_t ref = _pack(tree, n.child[c], self);
+    // the vector may have grown so index it again each time
+    _nodes[self].child[c] = ref;
+    _nodes[self].bounds[c] = _bounds(tree, ref);
+  }
+  return self;
+}
+
+aabb_t packed_bvh_t::_bounds(const bvh_t &tree, int32_t ref) const {
+  if (packed_node_t::is_leaf(ref)) {
+    return tree.get(_leaves[~ref].index).tight;
+  }
+  const packed_node_t &n = _nodes[ref];
+  return aabb_t::find_union(n.bounds[0], n.bounds[1]);
+}
+
+void packed_bvh_t::find_overlaps(const aabb_t &bb,
+                                 std::vector<index_t> &overlaps) const {
+  if (_empty) {
+    return;
+  }
+  if (!aabb_t::overlaps(bb, _root_bounds)) {
+    return;
+  }
+  if (packed_node_t::is_leaf(_root)) {
+    overlaps.push_back(_leaves[~_root].index);
+    return;
+  }
+  std::vector<int32_t> stack;
+  stack.reserve(c_stack_reserve);
+  stack.push_back(_root);
+  while (!stack.empty()) {
+    const packed_node_t &n = _nodes[stack.back()];
+    stack.pop_back();
+    for (int c = 0; c < 2; ++c) {
+      if (!aabb_t::overlaps(bb, n.bounds[c])) {
+        continue;
+      }
+      if (packed_node_t::is_leaf(n.child[c])) {
+        overlaps.push_back(_leaves[~n.child[c]].index);
       }
       else {
-        assert(n.child[0] != invalid_index);
-        assert(n.child[1] != invalid_index);
-        stack.back() = n.child[0];
-        stack.push_back(n.child[1]);
+        stack.push_back(n.child[c]);
+      }
+    }
+  }
+}
+
+size_t numa_nodes() {
+#if BVH_NUMA
+  // numa_available() is a system call so only ask once
+  static const size_t count =
+    (numa_available() >= 0) ? size_t(numa_max_node() + 1) : 1;
+  return count;
+#else
+  return 1;
+#endif
+}
+
+size_t current_numa_node() {
+#if BVH_NUMA
+  if (numa_nodes() > 1) {
+    const int cpu = sched_getcpu();
+    const auto &table = cpu_nodes();
+    if (cpu >= 0 && size_t(cpu) < table.size()) {
+      return table[cpu];
+    }
+  }
+#endif
+  return 0;
+}
+
+bool run_on_numa_node(size_t node) {
+#if BVH_NUMA
+  if (numa_nodes() > 1 && node < numa_nodes()) {
+    if (numa_run_on_node(int(node)) != 0) {
+      return false;
+    }
+    numa_set_preferred(int(node));
+    return true;
+  }
+#endif
+  return node == 0;
+}
+
+void replicated_bvh_t::build(const bvh_t &tree) {
+  const size_t nodes = numa_nodes();
+  _replicas.resize(nodes);
+  if (nodes == 1) {
+    _replicas[0].build(tree);
+    return;
+  }
+  packed_bvh_t master;
+  master.build(tree);
+  // copy from a thread on each node so the copys pages are placed there
+  std::vector<std::thread> workers;
+  workers.reserve(nodes);
+  for (size_t n = 0; n < nodes; ++n) {
+    workers.emplace_back([&, n]() {
+      run_on_numa_node(n);
+      _replicas[n] = master;
+    });
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+}
+
+const packed_bvh_t &replicated_bvh_t::local() const {
+  assert(!_replicas.empty());
+  if (_replicas.size() == 1) {
+    return _replicas[0];
+  }
+  const size_t node = current_numa_node();
+  return _replicas[(node < _replicas.size()) ? node : 0];
+}
+
+size_t replicated_bvh_t::memory() const {
+  size_t bytes = 0;
+  for (const auto &r : _replicas) {
+    bytes += r.memory();
+  }
+  return bytes;
+}
+
+nearest_t::nearest_t(const bvh_t &tree, float x, float y)
+  : _tree(tree)
+  , _x(x)
+  , _y(y)
+  , _visited(0)
+{
+  _heap.reserve(c_stack_reserve);
+  if (!tree.empty()) {
+    _push(entry_t{ _distance(tree.root().tight), tree.root_index() });
+  }
+}
+
+float nearest_t::_distance(const aabb_t &a) const {
+  const float dx = std::max(std::max(a.minx - _x, _x - a.maxx), 0.f);
+  const float dy = std::max(std::max(a.miny - _y, _y - a.maxy), 0.f);
+  return dx * dx + dy * dy;
+}
+
+void nearest_t::_push(const entry_t &e) {
+  _heap.push_back(e);
+  std::push_heap(_heap.begin(), _heap.end());
+}
+
+bool nearest_t::next(index_t &index, float &distance) {
+  while (!_heap.empty()) {
+    std::pop_heap(_heap.begin(), _heap.end());
+    const entry_t e = _heap.back();
+    _heap.pop_back();
+    ++_visited;
+    const node_t &n = _tree.get(e.index);
+    if (n.count == 0) {
+      continue;
+    }
+    if (n.is_leaf()) {
+      // nothing left in the queue can be any closer than this
+      index = e.index;
+      distance = sqrtf(e.dist);
+      return true;
+    }
+    const node_t &c0 = _tree.get(n.child[0]);
+    const node_t &c1 = _tree.get(n.child[1]);
+    _push(entry_t{ _distance(c0.tight), n.child[0] });
+    _push(entry_t{ _distance(c1.tight), n.child[1] });
+  }
+  return false;
+}
+
+paged_bvh_t::paged_bvh_t()
+  : _fd(-1)
+  , _page_size(0)
+  , _leaves(0)
+  , _pages(0)
+  , _root(0)
+  , _bounds{ 0.f, 0.f, 0.f, 0.f }
+  , _head(c_no_slot)
+  , _tail(c_no_slot)
+  , _used(0)
+{
+}
+
+paged_bvh_t::~paged_bvh_t() {
+  close();
+}
+
+bool paged_bvh_t::write(const char *path, const std::vector<aabb_t> &boxes,
+                        uint32_t page_size) {
+  aabb_t bounds = boxes.empty() ? aabb_t{ 0.f, 0.f, 0.f, 0.f } : boxes[0];
+  for (const aabb_t &b : boxes) {
+    bounds = aabb_t::find_union(bounds, b);
+  }
+  std::vector<paged_entry_t> entries(boxes.size());
+  for (size_t i = 0; i < boxes.size(); ++i) {
+    entries[i] = paged_entry_t{ morton_code(boxes[i], bounds),
+                                paged_index_t(i), boxes[i] };
+  }
+  std::sort(entries.begin(), entries.end());
+  paged_writer_t writer;
+  if (!writer.open(path, page_size, bounds)) {
+    return false;
+  }
+  for (const paged_entry_t &e : entries) {
+    if (!writer.add(e)) {
+      return false;
+    }
+  }
+  return writer.finish();
+}
+
+bool paged_bvh_t::write_external(const char *boxes, const char *path,
+                                 uint32_t page_size, size_t memory) {
+  // bytes read from the snapshot at a time
+  static const size_t c_chunk = 64 * 1024;
+  // smallest buffer a run is merged through
+  static const size_t c_min_buffer = 64 * 1024;
+  assert(memory >= 2 * c_min_buffer);
+  chunk_stream_t stream;
+  boxes_file_t file;
+  if (!stream.open(boxes, sizeof(file), c_chunk, 4, true) ||
+      !read_boxes_header(stream.fd, file)) {
+    return false;
+  }
+  const size_t run_size = memory / sizeof(paged_entry_t);
+  std::vector<paged_entry_t> run;
+  run.reserve(size_t(std::min<uint64_t>(run_size, file.count)));
+  spill_file_t spill[2];
+  std::vector<spill_run_t> runs;
+  // sort the run in hand and append it to the spill file
+  const auto flush = [&]() {
+    std::sort(run.begin(), run.end());
+    if (runs.empty() && !spill[0].open(std::string(path) + ".run0")) {
+      return false;
+    }
+    runs.push_back(spill_run_t{ spill[0].end, run.size() });
+    const bool ok = spill[0].append(run.data(), run.size());
+    run.clear();
+    return ok;
+  };
+  uint64_t next = 0;
+  const uint8_t *data = nullptr;
+  size_t bytes = 0;
+  while (stream.next(data, bytes)) {
+    for (size_t i = 0; i < bytes / sizeof(aabb_t); ++i) {
+      aabb_t aabb;
+      memcpy(&aabb, data + i * sizeof(aabb_t), sizeof(aabb_t));
+      run.push_back(paged_entry_t{ morton_code(aabb, file.bounds), next++,
+                                   aabb });
+      if (run.size() == run_size && !flush()) {
+        return false;
+      }
+    }
+    stream.release();
+  }
+  if (stream.failed || next != file.count) {
+    return false;
+  }
+  paged_writer_t writer;
+  if (!writer.open(path, page_size, file.bounds)) {
+    return false;
+  }
+  const auto add = [&](const paged_entry_t &e) {
+    return writer.add(e);
+  };
+  if (runs.empty()) {
+    // everything fit in memory so there is nothing to merge
+    std::sort(run.begin(), run.end());
+    for (const paged_entry_t &e : run) {
+      if (!add(e)) {
+        return false;
+      }
+    }
+    return writer.finish();
+  }
+  if (!run.empty() && !flush()) {
+    return false;
+  }
+  std::vector<paged_entry_t>().swap(run);
+  // merge groups of runs into longer ones until the rest fit in one pass,
+  // with one more buffer for the merged output
+  const size_t fan_in = std::max<size_t>(memory / c_min_buffer - 1, 2);
+  int from = 0;
+  while (runs.size() > fan_in) {
+    spill_file_t &to = spill[from ^ 1];
+    if (!to.open(std::string(path) + (from ? ".run0" : ".run1"))) {
+      return false;
+    }
+    const size_t entries = memory / ((fan_in + 1) * sizeof(paged_entry_t));
+    std::vector<paged_entry_t> out;
+    out.reserve(entries);
+    std::vector<spill_run_t> merged;
+    for (size_t r = 0; r < runs.size(); r += fan_in) {
+      const size_t count = std::min(fan_in, runs.size() - r);
+      merged.push_back(spill_run_t{ to.end, 0 });
+      const auto append = [&](const paged_entry_t &e) {
+        out.push_back(e);
+        ++merged.back().count;
+        if (out.size() < entries) {
+          return true;
+        }
+        const bool ok = to.append(out.data(), out.size());
+        out.clear();
+        return ok;
+      };
+      if (!merge_runs(spill[from].fd, &runs[r], count, entries, append) ||
+          !to.append(out.data(), out.size())) {
+        return false;
+      }
+      out.clear();
+    }
+    spill[from].close();
+    runs.swap(merged);
+    from ^= 1;
+  }
+  const size_t entries = memory / (runs.size() * sizeof(paged_entry_t));
+  return merge_runs(spill[from].fd, runs.data(), runs.size(), entries, add) &&
+         writer.finish();
+}
+
+bool paged_bvh_t::open(const char *path, size_t cache_pages) {
+  close();
+  _fd = ::open(path, O_RDONLY);
+  if (_fd < 0) {
+    return false;
+  }
+  paged_file_t file;
+  struct stat st;
+  if (!read_at(_fd, &file, sizeof(file), 0) ||
+      memcmp(file.magic, c_paged_magic, sizeof(file.magic)) != 0 ||
+      file.version != c_paged_version || fstat(_fd, &st) != 0 ||
+      !paged_file_fits(file, uint64_t(st.st_size))) {
+    close();
+    return false;
+  }
+  _page_size = file.page_size;
+  _leaves = file.leaves;
+  _pages = file.pages;
+  _root = file.root;
+  _bounds = file.bounds;
+  _top.resize(size_t(file.top_nodes));
+  if (!read_at(_fd, _top.data(), _top.size() * sizeof(paged_node_t),
+               file.top_offset)) {
+    close();
+    return false;
+  }
+  // there is no point holding more slots than there are pages
+  const size_t slots =
+    std::max<size_t>(std::min<size_t>(cache_pages, size_t(_pages)), 1);
+  _cache.assign(slots * _page_size, 0);
+  _slot_page.assign(slots, 0);
+  _prev.assign(slots, c_no_slot);
+  _next.assign(slots, c_no_slot);
+  _resident.reserve(slots);
+  // every top level node comes after its children, so walks always end
+  for (size_t i = 0; i < _top.size(); ++i) {
+    for (int32_t c : _top[i].child) {
+      if (c >= 0 ? size_t(c) >= i : uint64_t(~c) >= _pages) {
+        close();
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void paged_bvh_t::close() {
+  if (_fd >= 0) {
+    ::close(_fd);
+  }
+  _fd = -1;
+  _leaves = 0;
+  _pages = 0;
+  // release the storage as well, as the cache may be large
+  std::vector<paged_node_t>().swap(_top);
+  std::vector<uint8_t>().swap(_cache);
+  std::vector<uint64_t>().swap(_slot_page);
+  std::vector<uint32_t>().swap(_prev);
+  std::vector<uint32_t>().swap(_next);
+  _head = _tail = c_no_slot;
+  _used = 0;
+  std::unordered_map<uint64_t, uint32_t>().swap(_resident);
+  _stats = page_stats_t();
+}
+
+void paged_bvh_t::_unlink(uint32_t slot) {
+  if (_prev[slot] != c_no_slot) {
+    _next[_prev[slot]] = _next[slot];
+  }
+  else {
+    _head = _next[slot];
+  }
+  if (_next[slot] != c_no_slot) {
+    _prev[_next[slot]] = _prev[slot];
+  }
+  else {
+    _tail = _prev[slot];
+  }
+}
+
+void paged_bvh_t::_link(uint32_t slot) {
+  _prev[slot] = c_no_slot;
+  _next[slot] = _head;
+  if (_head != c_no_slot) {
+    _prev[_head] = slot;
+  }
+  _head = slot;
+  if (_tail == c_no_slot) {
+    _tail = slot;
+  }
+}
+
+const uint8_t *paged_bvh_t::_page(uint64_t page) {
+  assert(page < _pages);
+  auto itt = _resident.find(page);
+  if (itt != _resident.end()) {
+    ++_stats.hits;
+    if (itt->second != _head) {
+      _unlink(itt->second);
+      _link(itt->second);
+    }
+    return _cache.data() + size_t(itt->second) * _page_size;
+  }
+  ++_stats.faults;
+  // take a free slot or evict the least recently used page
+  uint32_t slot = _used;
+  const bool fresh = _used < _slot_page.size();
+  if (fresh) {
+    ++_used;
+  }
+  else {
+    slot = _tail;
+    _unlink(slot);
+    _resident.erase(_slot_page[slot]);
+  }
+  uint8_t *data = _cache.data() + size_t(slot) * _page_size;
+  if (!read_at(_fd, data, _page_size, (page + 1) * _page_size) ||
+      !page_is_valid(data, _page_size)) {
+    ++_stats.errors;
+    // leave the slot empty at the back of the list to be taken first, so
+    // a later request tries the read again
+    if (fresh) {
+      --_used;
+    }
+    else {
+      _slot_page[slot] = c_no_page;
+      _prev[slot] = _tail;
+      _next[slot] = c_no_slot;
+      if (_tail != c_no_slot) {
+        _next[_tail] = slot;
+      }
+      else {
+        _head = slot;
+      }
+      _tail = slot;
+    }
+    return nullptr;
+  }
+  _slot_page[slot] = page;
+  _resident.emplace(page, slot);
+  _link(slot);
+  return data;
+}
+
+template <typename test_t>
+bool paged_bvh_t::_query(const test_t &test,
+                         std::vector<paged_index_t> &out) {
+  if (_fd < 0 || _leaves == 0 || !test(_bounds)) {
+    return true;
+  }
+  bool ok = true;
+  std::vector<int32_t> stack, inner;
+  stack.reserve(c_stack_reserve);
+  inner.reserve(c_stack_reserve);
+  stack.push_back(_root);
+  while (!stack.empty()) {
+    const int32_t ref = stack.back();
+    stack.pop_back();
+    if (ref >= 0) {
+      // a resident node with its childrens bounds inline
+      const paged_node_t &n = _top[ref];
+      for (int c = 1; c >= 0; --c) {
+        if (test(n.bounds[c])) {
+          stack.push_back(n.child[c]);
+        }
+      }
+      continue;
+    }
+    // a page whose bounds passed, so walk the subtree inside it
+    const uint8_t *data = _page(uint64_t(~ref));
+    if (!data) {
+      ok = false;
+      continue;
+    }
+    const page_header_t &head = *reinterpret_cast<const page_header_t*>(data);
+    const paged_node_t *nodes =
+      reinterpret_cast<const paged_node_t*>(data + sizeof(page_header_t));
+    const paged_leaf_t *slots = reinterpret_cast<const paged_leaf_t*>(
+      data + sizeof(page_header_t) + head.nodes * sizeof(paged_node_t));
+    inner.push_back(head.root);
+    while (!inner.empty()) {
+      const int32_t i = inner.back();
+      inner.pop_back();
+      if (i < 0) {
+        out.push_back(slots[~i].index);
         continue;
       }
+      const paged_node_t &n = nodes[i];
+      for (int c = 1; c >= 0; --c) {
+        if (test(n.bounds[c])) {
+          inner.push_back(n.child[c]);
+        }
+      }
+    }
+  }
+  return ok;
+}
+
+bool paged_bvh_t::find_overlaps(const aabb_t &bb,
+                                std::vector<paged_index_t> &overlaps) {
+  return _query([&](const aabb_t &b) { return aabb_t::overlaps(bb, b); },
+                overlaps);
+}
+
+bool paged_bvh_t::raycast(float x0, float y0, float x1, float y1,
+                          std::vector<paged_index_t> &overlaps) {
+  const segment_t seg(x0, y0, x1, y1);
+  return _query([&](const aabb_t &b) { return seg.hits(b); }, overlaps);
+}
+
+shared_bvh_t::shared_bvh_t()
+  : _base(nullptr)
+  , _size(0)
+  , _epoch{ 0, 0 }
+  , _copied(0)
+{
+}
+
+shared_bvh_t::~shared_bvh_t() {
+  close();
+}
+
+bool shared_bvh_t::create(const char *name) {
+  close();
+  shm_unlink(name);
+  const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  const size_t size = shared_size(bvh_t::capacity());
+  void *base = MAP_FAILED;
+  if (ftruncate(fd, off_t(size)) == 0) {
+    base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (base == MAP_FAILED) {
+    shm_unlink(name);
+    return false;
+  }
+  _name = name;
+  _base = static_cast<uint8_t*>(base);
+  _size = size;
+  _epoch[0] = _epoch[1] = 0;
+  _copied = 0;
+  // the segment starts zeroed, so set the header up before the magic which
+  // readers check on open
+  shared_header_t *h = new (_base) shared_header_t;
+  h->version = c_shared_version;
+  h->nodes = uint32_t(bvh_t::capacity());
+  h->published.store(0, std::memory_order_relaxed);
+  for (int b = 0; b < 2; ++b) {
+    h->sequence[b].store(0, std::memory_order_relaxed);
+    h->held[b] = 0;
+    h->root[b] = invalid_index;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(h->magic, c_shared_magic, sizeof(h->magic));
+  return true;
+}
+
+void shared_bvh_t::close() {
+  if (_base) {
+    munmap(_base, _size);
+    shm_unlink(_name.c_str());
+  }
+  _base = nullptr;
+  _size = 0;
+  _name.clear();
+}
+
+uint64_t shared_bvh_t::publish(bvh_t &tree) {
+  assert(_base);
+  shared_header_t &h = *reinterpret_cast<shared_header_t*>(_base);
+  const uint64_t version = h.published.load(std::memory_order_relaxed) + 1;
+  const size_t b = size_t(version & 1);
+  shared_node_t *nodes = reinterpret_cast<shared_node_t*>(
+      _base + c_shared_nodes) + b * h.nodes;
+  const uint32_t ended = tree.new_epoch();
+  // readers still in this copy from two versions ago will see the odd count
+  // and start again
+  const uint64_t seq = h.sequence[b].load(std::memory_order_relaxed);
+  h.sequence[b].store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  // every node this copy is missing changed since it was last filled
+  _copied = 0;
+  tree.visit_changed_since(_epoch[b], [&](index_t i, const node_t &n) {
+    shared_node_t &s = nodes[i];
+    s.tight = n.tight;
+    s.child = n.child;
+    s.count = n.count;
+    ++_copied;
+  });
+  h.held[b] = version;
+  h.root[b] = tree.root_index();
+  h.sequence[b].store(seq + 2, std::memory_order_release);
+  h.published.store(version, std::memory_order_release);
+  _epoch[b] = ended;
+  return version;
+}
+
+uint64_t shared_bvh_t::version() const {
+  assert(_base);
+  const shared_header_t &h = *reinterpret_cast<const shared_header_t*>(_base);
+  return h.published.load(std::memory_order_acquire);
+}
+
+shared_view_t::shared_view_t()
+  : _base(nullptr)
+  , _size(0)
+  , _retries(0)
+{
+}
+
+shared_view_t::~shared_view_t() {
+  close();
+}
+
+bool shared_view_t::open(const char *name) {
+  close();
+  const int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  void *base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && size_t(st.st_size) >= c_shared_nodes) {
+    base = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  _base = static_cast<const uint8_t*>(base);
+  _size = size_t(st.st_size);
+  const shared_header_t &h = *reinterpret_cast<const shared_header_t*>(_base);
+  if (memcmp(h.magic, c_shared_magic, sizeof(h.magic)) != 0 ||
+      h.version != c_shared_version || _size != shared_size(h.nodes)) {
+    close();
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return true;
+}
+
+void shared_view_t::close() {
+  if (_base) {
+    munmap(const_cast<uint8_t*>(_base), _size);
+  }
+  _base = nullptr;
+  _size = 0;
+}
+
+uint64_t shared_view_t::find_overlaps(const aabb_t &bb,
+                                      std::vector<index_t> &overlaps) const {
+  assert(_base);
+  const shared_header_t &h = *reinterpret_cast<const shared_header_t*>(_base);
+  const size_t start = overlaps.size();
+  std::vector<index_t> stack;
+  stack.reserve(c_stack_reserve);
+  // walk one copy as bvh_t::find_overlaps() does. the copy may be refilled
+  // under us, so indices are checked and the walk is bounded to stay safe
+  // on torn nodes, whose results are thrown away below.
+  const auto walk = [&](size_t b) {
+    const shared_node_t *nodes = reinterpret_cast<const shared_node_t*>(
+        _base + c_shared_nodes) + b * h.nodes;
+    stack.clear();
+    if (h.root[b] != invalid_index) {
+      stack.push_back(h.root[b]);
+    }
+    for (uint32_t visits = 0; !stack.empty(); ++visits) {
+      const index_t ni = stack.back();
+      if (ni < 0 || uint32_t(ni) >= h.nodes || visits >= h.nodes) {
+        return false;
+      }
+      const shared_node_t &n = nodes[ni];
+      if (n.count != 0 && aabb_t::overlaps(bb, n.tight)) {
+        if (n.child[0] == invalid_index) {
+          overlaps.push_back(ni);
+        }
+        else {
+          stack.back() = n.child[0];
+          stack.push_back(n.child[1]);
+          continue;
+        }
+      }
+      stack.pop_back();
+    }
+    return true;
+  };
+  for (;;) {
+    const uint64_t version = h.published.load(std::memory_order_acquire);
+    if (version == 0) {
+      return 0;
+    }
+    const size_t b = size_t(version & 1);
+    const uint64_t seq = h.sequence[b].load(std::memory_order_acquire);
+    if ((seq & 1) == 0) {
+      const uint64_t held = h.held[b];
+      const bool ok = walk(b);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (ok && h.sequence[b].load(std::memory_order_relaxed) == seq) {
+        return held;
+      }
+    }
+    overlaps.resize(start);
+    _retries.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+uint64_t shared_view_t::version() const {
+  assert(_base);
+  const shared_header_t &h = *reinterpret_cast<const shared_header_t*>(_base);
+  return h.published.load(std::memory_order_acquire);
+}
+
+island_builder_t::island_builder_t()
+  : _parent(bvh_t::capacity())
+  , _degree(bvh_t::capacity(), 0)
+  , _island_of(bvh_t::capacity(), 0)
+  , _reset(bvh_t::capacity(), 0)
+{
+  clear();
+}
+
+void island_builder_t::clear() {
+  for (size_t i = 0; i < _parent.size(); ++i) {
+    _parent[i].store(index_t(i), std::memory_order_relaxed);
+  }
+  std::fill(_degree.begin(), _degree.end(), 0);
+  _pairs.clear();
+  _bodies.clear();
+  _islands.clear();
+}
+
+index_t island_builder_t::find(index_t i) const {
+  assert(i >= 0 && i < index_t(_parent.size()));
+  index_t p;
+  while ((p = _parent[i].load(std::memory_order_relaxed)) != i) {
+    i = p;
+  }
+  return i;
+}
+
+index_t island_builder_t::_find(index_t i) {
+  for (;;) {
+    index_t p = _parent[i].load(std::memory_order_relaxed);
+    if (p == i) {
+      return i;
+    }
+    const index_t g = _parent[p].load(std::memory_order_relaxed);
+    if (p != g) {
+      // point at the grandparent. if another thread got there first it can
+      // only have moved the link further up the same path.
+      _parent[i].compare_exchange_weak(p, g, std::memory_order_relaxed);
+    }
+    i = g;
+  }
+}
+
+void island_builder_t::_unite(index_t a, index_t b) {
+  for (;;) {
+    a = _find(a);
+    b = _find(b);
+    if (a == b) {
+      return;
+    }
+    // always hang the higher root under the lower so links only point down
+    // in index, which rules out cycles and makes the roots deterministic
+    if (a > b) {
+      std::swap(a, b);
+    }
+    index_t expect = b;
+    if (_parent[b].compare_exchange_strong(expect, a,
+                                           std::memory_order_relaxed)) {
+      return;
+    }
+    // b was linked by another thread in the meantime so try again
+  }
+}
+
+template <typename filter_t>
+void island_builder_t::_unite_all(
+    const std::vector<std::pair<index_t, index_t>> &pairs,
+    uint32_t threads, filter_t &&filter) {
+  // hand out the pairs in fixed size chunks
+  const size_t chunk = 1024;
+  const size_t tasks = (pairs.size() + chunk - 1) / chunk;
+  parallel_for(tasks, threads, [&](uint32_t, size_t t) {
+    const size_t end = std::min(pairs.size(), (t + 1) * chunk);
+    for (size_t i = t * chunk; i < end; ++i) {
+      if (filter(pairs[i].first)) {
+        _unite(pairs[i].first, pairs[i].second);
+      }
+    }
+  });
+}
+
+void island_builder_t::update(
+    const std::vector<std::pair<index_t, index_t>> &pairs,
+    uint32_t threads) {
+  std::vector<std::pair<index_t, index_t>> sorted(pairs);
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  // find the pairs which began and ended since the last update
+  std::vector<std::pair<index_t, index_t>> began, ended;
+  std::set_difference(sorted.begin(), sorted.end(),
+                      _pairs.begin(), _pairs.end(),
+                      std::back_inserter(began));
+  std::set_difference(_pairs.begin(), _pairs.end(),
+                      sorted.begin(), sorted.end(),
+                      std::back_inserter(ended));
+  _pairs.swap(sorted);
+  _apply(began, ended, threads);
+}
+
+void island_builder_t::update(
+    const std::vector<std::pair<index_t, index_t>> &began,
+    const std::vector<std::pair<index_t, index_t>> &ended,
+    uint32_t threads) {
+  std::vector<std::pair<index_t, index_t>> b(began), e(ended);
+  std::sort(b.begin(), b.end());
+  std::sort(e.begin(), e.end());
+  // apply the changes to the pairs from the last update
+  std::vector<std::pair<index_t, index_t>> pairs;
+  pairs.reserve(_pairs.size() + b.size());
+  std::set_difference(_pairs.begin(), _pairs.end(), e.begin(), e.end(),
+                      std::back_inserter(pairs));
+  const size_t mid = pairs.size();
+  pairs.insert(pairs.end(), b.begin(), b.end());
+  std::inplace_merge(pairs.begin(), pairs.begin() + mid, pairs.end());
+  _pairs.swap(pairs);
+  _apply(b, e, threads);
+}
+
+void island_builder_t::_apply(
+    const std::vector<std::pair<index_t, index_t>> &began,
+    const std::vector<std::pair<index_t, index_t>> &ended,
+    uint32_t threads) {
+  threads = thread_count(threads);
+  for (const auto &p : began) {
+    assert(p.first != p.second);
+    ++_degree[p.first];
+    ++_degree[p.second];
+  }
+  for (const auto &p : ended) {
+    --_degree[p.first];
+    --_degree[p.second];
+  }
+
+  if (!ended.empty()) {
+    // union-find cannot split, so islands which lost a pair are taken apart
+    // and linked again from the pairs they still have
+    std::vector<uint8_t> split(_islands.size(), 0);
+    for (const auto &p : ended) {
+      split[_island_of[p.first]] = 1;
+    }
+    std::vector<index_t> reset;
+    for (size_t k = 0; k < _islands.size(); ++k) {
+      if (split[k]) {
+        const island_t &is = _islands[k];
+        reset.insert(reset.end(), _bodies.begin() + is.begin,
+                     _bodies.begin() + is.end);
+      }
+    }
+    for (index_t i : reset) {
+      _parent[i].store(i, std::memory_order_relaxed);
+      _reset[i] = 1;
+    }
+    // both leaves of a pair were in the same island so checking one is enough
+    _unite_all(_pairs, threads, [&](index_t a) { return _reset[a] != 0; });
+    for (index_t i : reset) {
+      _reset[i] = 0;
+    }
+  }
+  _unite_all(began, threads, [](index_t) { return true; });
+
+  _emit();
+}
+
+void island_builder_t::_emit() {
+  _bodies.clear();
+  _islands.clear();
+  // each root is the lowest leaf of its island so visiting the leaves in
+  // order meets the islands in order of their root
+  for (size_t i = 0; i < _parent.size(); ++i) {
+    if (_degree[i] == 0) {
+      continue;
+    }
+    const index_t r = _find(index_t(i));
+    if (r == index_t(i)) {
+      _island_of[i] = uint32_t(_islands.size());
+      _islands.push_back(island_t{ 0, 0 });
+    }
+    else {
+      _island_of[i] = _island_of[r];
+    }
+    ++_islands[_island_of[i]].end;
+  }
+  // turn the sizes into ranges
+  uint32_t begin = 0;
+  for (island_t &is : _islands) {
+    const uint32_t size = is.end;
+    is.begin = is.end = begin;
+    begin += size;
+  }
+  _bodies.resize(begin);
+  for (size_t i = 0; i < _parent.size(); ++i) {
+    if (_degree[i] != 0) {
+      _bodies[_islands[_island_of[i]].end++] = index_t(i);
     }
-    // pop node
-    stack.resize(stack.size() - 1);
   }
 }
 
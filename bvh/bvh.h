@@ -1,7 +1,15 @@
 #pragma once
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 
@@ -18,6 +26,8 @@ struct aabb_t {
   // upper bound
   float maxx, maxy;
 
+  // return true if a line segment hits this aabb, with a small tolerance
+  // so that a segment grazing an edge or corner still hits.
   bool raycast(float x0, float y0, float x1, float y1) const;
 
   float area() const {
@@ -62,17 +72,45 @@ struct aabb_t {
   }
 };
 
+// a line segment from (x0, y0) to (x1, y1)
+struct ray_t {
+  float x0, y0;
+  float x1, y1;
+};
+
+// a circular sector with its apex at (x, y), reaching out to 'radius' and
+// covering 'half_angle' radians either side of the direction (dx, dy)
+struct sector_t {
+  float x, y;
+  float dx, dy;
+  float radius;
+  float half_angle;
+};
+
 struct node_t {
 
   // for a leaf this will be a fat aabb and non terminal nodes will be regular
   struct aabb_t aabb;
 
+  // for a leaf this is the aabb last given by the user, and for non terminal
+  // nodes a bound on the tight aabbs of the leaves below
+  struct aabb_t tight;
+
   // left and right children
   std::array<index_t, 2> child;
 
   // index of the parent node
   index_t parent;
 
+  // epoch in which this node, or any node below it, last changed
+  uint32_t stamp;
+
+  // number of live leaves in this subtree (zero for a dead leaf)
+  uint32_t count;
+
+  // set if this leaf, or every leaf in this subtree, is asleep
+  bool asleep;
+
   // user provided data
   void *user_data;
 
@@ -92,6 +130,131 @@ struct node_t {
   }
 };
 
+// breakdown of the memory used by a tree (all values are in bytes)
+struct memory_usage_t {
+
+  // node storage currently linked into the tree
+  size_t nodes_used;
+
+  // node storage reserved for the tree (used and free)
+  size_t nodes_reserved;
+
+  // transient scratch space needed by inserts and queries
+  size_t scratch;
+
+  // portion of the used node storage holding user payload
+  size_t payload;
+
+  // auxiliary structures held alongside the nodes
+  size_t side;
+
+  // portion of the side structures held for every node slot, which grows
+  // with the node capacity rather than being fixed
+  size_t side_per_node;
+
+  // total footprint of the tree
+  size_t total() const {
+    return nodes_reserved + scratch + side;
+  }
+};
+
+// how the tree is maintained as its leaves move
+enum class maintenance_t : uint8_t {
+  // grow escaped leaves in place and refit their ancestors
+  refit,
+  // unlink escaped leaves and insert them again
+  reinsert,
+  // rebuild degraded subtrees in place
+  partial_rebuild,
+  // rebuild the whole tree
+  full_rebuild,
+};
+
+// statistics gathered over one frame
+struct frame_stats_t {
+
+  // number of calls to move()
+  uint32_t movers = 0;
+
+  // number of moves which escaped their fat aabb
+  uint32_t escapes = 0;
+
+  // number of queries made
+  uint32_t queries = 0;
+
+  // nodes visited by queries
+  uint64_t query_nodes = 0;
+
+  // nodes visited while updating the tree
+  uint64_t update_nodes = 0;
+
+  // leaves whose fat aabb was hit by queries
+  uint64_t leaf_hits = 0;
+
+  // leaves whose fat aabb was hit by queries but whose tight aabb missed
+  uint64_t false_positives = 0;
+
+  // tree quality at the end of the frame
+  float quality = 0.f;
+
+  // maintenance chosen at the end of the frame
+  maintenance_t decision = maintenance_t::reinsert;
+};
+
+// one sample taken by the growth tuner
+struct growth_sample_t {
+
+  // growth in use while the sample was gathered
+  float growth;
+
+  // fraction of moves which escaped their fat aabb
+  float escape_rate;
+
+  // fraction of query leaf hits which only hit the fat aabb
+  float false_positive_rate;
+
+  // mean nodes visited per frame by updates and queries
+  float cost;
+};
+
+// how bvh_t::load() reads its file
+enum class io_mode_t : uint8_t {
+  // reads are queued on an io_uring, or a reader thread where that is not
+  // available
+  io_uring,
+  // a reader thread makes blocking reads
+  threads,
+};
+
+// statistics from the last bvh_t::load()
+struct load_stats_t {
+
+  // boxes inserted
+  uint64_t boxes = 0;
+
+  // chunks read
+  uint32_t chunks = 0;
+
+  // seconds spent waiting for a chunk to be read
+  double wait = 0.;
+
+  // seconds spent inserting chunks
+  double build = 0.;
+
+  // set if reads went through io_uring
+  bool io_uring = false;
+};
+
+// write boxes to a snapshot file, a short header holding their bounds and
+// then the packed aabb_t records, as read by read_boxes() and bvh_t::load()
+bool write_boxes(const char *path, const std::vector<aabb_t> &boxes);
+
+// read all of the boxes in a file written by write_boxes()
+bool read_boxes(const char *path, std::vector<aabb_t> &boxes);
+
+// a leaf being sorted by the binned sah builder
+struct sah_leaf_t;
+
 struct bvh_t {
 
   bvh_t();
@@ -102,12 +265,76 @@ struct bvh_t {
   // create a new node in the tree
   index_t insert(const aabb_t &aabb, void *user_data);
 
+  // create many new nodes in the tree, returning their indices in 'out'
+  // in the same order as the input. user_data may be empty.
+  void insert_batch(const std::vector<aabb_t> &aabbs,
+                    const std::vector<void*> &user_data,
+                    std::vector<index_t> &out);
+
+  // insert every box in a file written by write_boxes(), as insert_batch()
+  // would, returning their indices in 'out' in file order. the file is read
+  // in chunks of 'chunk' boxes with reads kept in flight, and the leaves of
+  // each chunk are created and morton sorted while the next is loading, so
+  // only merging the sorted chunks and linking them in is left once the last
+  // arrives. leaves are given null user data. returns false, leaving the
+  // tree untouched, if the file could not be read or its boxes would not
+  // fit in the free capacity of the tree.
+  bool load(const char *path, size_t chunk, std::vector<index_t> &out,
+            io_mode_t mode = io_mode_t::io_uring);
+
   // remove a node from the tree
   void remove(index_t index);
 
+  // remove many nodes from the tree at once
+  void remove_batch(const std::vector<index_t> &indices);
+
+  // mark a leaf as dead without unlinking it. queries skip dead leaves and
+  // the tree is left untouched other than the live counts and keys of its
+  // ancestors, so this costs O(depth) rather than O(1), but nothing is
+  // unlinked or refit. dead leaves are removed by cleanup() or the next
+  // rebuild().
+  void kill(index_t index);
+
+  // remove up to 'budget' dead leaves (or all of them if zero) in one batch,
+  // returning the number removed
+  size_t cleanup(size_t budget);
+
+  // number of leaves killed since they were last cleaned up
+  size_t dead() const {
+    return _dead.size();
+  }
+
   // move an existing node in the tree
   void move(index_t index, const aabb_t &aabb);
 
+  // move many existing nodes in the tree, skipping any which are asleep
+  void move_batch(const std::vector<index_t> &indices,
+                  const std::vector<aabb_t> &aabbs);
+
+  // put a leaf to sleep. sleeping leaves are skipped by move_batch() and
+  // pairs of sleeping leaves are not reported by find_pairs().
+  void sleep(index_t index);
+
+  // wake a sleeping leaf. moving a leaf with move() also wakes it.
+  void wake(index_t index);
+
+  // return true if a leaf is asleep
+  bool asleep(index_t index) const {
+    assert(index >= 0 && index < index_t(_nodes.size()));
+    return _nodes[index].asleep;
+  }
+
+  // set the priority key of a leaf, used by find_top_k(). leaves start with a
+  // key of zero.
+  void set_key(index_t index, float key);
+
+  // return the priority key of a leaf, or for an interior node the largest
+  // key of the live leaves below it
+  float key(index_t index) const {
+    assert(index >= 0 && index < index_t(_nodes.size()));
+    return _keys[index];
+  }
+
   // return a nodes user data
   void *user_data(index_t index) const {
     assert(index >= 0 && index < index_t(_nodes.size()));
@@ -130,30 +357,255 @@ struct bvh_t {
     return _root == invalid_index;
   }
 
+  // get the index of the root node, or invalid_index if the tree is empty
+  index_t root_index() const {
+    return _root;
+  }
+
   // this is the growth size for fat aabbs (they will be expanded by this)
   float growth;
 
-  // find all overlaps with a given bounding-box
+  // when set end_frame() will tune 'growth' from the observed escape and
+  // false positive rates to minimize update and query cost
+  bool auto_growth;
+
+  // samples taken by the growth tuner, oldest first
+  const std::vector<growth_sample_t> &growth_history() const {
+    return _growth_history;
+  }
+
+  // how leaves escaping their fat aabb are handled. this is chosen by
+  // end_frame() but may also be set by hand.
+  maintenance_t maintenance;
+
+  // choose the maintenance for the next frame based on the stats gathered
+  // over this one, possibly rebuilding part or all of the tree
+  void end_frame();
+
+  // rebuild the entire tree, removing any dead leaves
+  void rebuild();
+
+  // subtrees whose sah cost is this many times that of a rebuild are
+  // considered degraded
+  float degraded_ratio;
+
+  // rebuild, in place, every subtree whose sah cost exceeds that of an ideal
+  // rebuild by 'ratio'. only subtrees changed since the last call are
+  // checked, and a binned build is only tried on those whose area has grown
+  // past 'ratio' times the cost last measured for them. node indices are
+  // reused so handles and parent links remain valid. returns the number of
+  // subtrees rebuilt.
+  size_t rebuild_degraded(float ratio);
+
+  // stats for the frame in progress
+  const frame_stats_t &frame_stats() const {
+    return _frame;
+  }
+
+  // stats for recent frames, oldest first
+  const std::vector<frame_stats_t> &frame_history() const {
+    return _history;
+  }
+
+  // stats for the last call to load()
+  const load_stats_t &load_stats() const {
+    return _load;
+  }
+
+  // find all leaves whose tight aabb overlaps a given bounding-box.
+  // subtrees are culled on the tight bounds of their leaves.
   void find_overlaps(const aabb_t &bb, std::vector<index_t> &overlaps);
 
-  // find all overlaps with a given node
+  // find the k live leaves with the largest keys whose tight aabb overlaps a
+  // box, in order of decreasing key. nodes are visited best first on the
+  // largest key below them, so the walk ends as soon as k leaves are found
+  // and subtrees whose keys are all below the k-th best are never opened.
+  void find_top_k(const aabb_t &bb, size_t k, std::vector<index_t> &out);
+
+  // find all overlaps with the tight aabb of a given node
   void find_overlaps(index_t node, std::vector<index_t> &overlaps);
 
-  // find all overlaps with a line segment
+  // run many overlap queries across a number of threads (or one per core if
+  // zero). results[i] holds the overlaps of boxes[i] in the same order as
+  // find_overlaps() would give, whatever the thread count.
+  void find_overlaps_batch(const std::vector<aabb_t> &boxes,
+                           std::vector<std::vector<index_t>> &results,
+                           uint32_t threads);
+
+  // find every pair of leaves whose fat aabbs overlap, across a number of
+  // threads (or one per core if zero). the fat margins keep pairs from
+  // flickering as leaves move. pairs where both leaves are asleep are
+  // skipped. each pair holds the lower index first. the order of the pairs
+  // depends only on the tree and not on the thread count or scheduling.
+  void find_pairs(std::vector<std::pair<index_t, index_t>> &pairs,
+                  uint32_t threads);
+
+  // find the leaves which started or stopped overlapping a bounding box since
+  // the last call with the same query id. both outputs are sorted. when the
+  // box is unchanged only subtrees with leaves changed since then are visited.
+  void find_overlaps_delta(uint32_t query, const aabb_t &bb,
+                           std::vector<index_t> &added,
+                           std::vector<index_t> &removed);
+
+  // release the results held for a delta query
+  void release_query(uint32_t query);
+
+  // add the density of leaves to a w x h grid of floats covering 'area',
+  // adding one to every cell a leafs tight aabb overlaps. whole subtrees
+  // smaller than a cell add their leaf count to the cell holding their
+  // center. the grid is not cleared first.
+  void rasterize(const aabb_t &area, float *grid, int32_t w, int32_t h) const;
+
+  // as above, splitting the rows of the grid across a number of threads (or
+  // one per core if zero)
+  void rasterize(const aabb_t &area, float *grid, int32_t w, int32_t h,
+                 uint32_t threads) const;
+
+  // start a new epoch, returning the one just ended. nodes changed from now
+  // on will be visited by visit_changed_since() given the returned epoch.
+  uint32_t new_epoch() {
+    return _epoch++;
+  }
+
+  // visit every node in the tree which changed after 'epoch' ended, as
+  // visit(index_t, const node_t &). subtrees without changes are skipped.
+  // removed leaves are not visited but their old ancestors are.
+  template <typename visit_t>
+  void visit_changed_since(uint32_t epoch, visit_t &&visit) const {
+    std::vector<index_t> stack;
+    if (_root != invalid_index) {
+      stack.push_back(_root);
+    }
+    while (!stack.empty()) {
+      const index_t i = stack.back();
+      stack.pop_back();
+      const node_t &node = _get(i);
+      if (node.stamp <= epoch) {
+        continue;
+      }
+      visit(i, node);
+      if (!node.is_leaf()) {
+        stack.push_back(node.child[1]);
+        stack.push_back(node.child[0]);
+      }
+    }
+  }
+
+  // pick k leaves overlapping a box uniformly at random, independently so a
+  // leaf may be picked more than once, using a standard random bit generator.
+  // subtrees inside the box are sampled through their leaf counts so the
+  // cost depends on the edge of the box and k, not on how many leaves it
+  // holds.
+  template <typename rng_t>
+  void sample_in_region(const aabb_t &bb, size_t k, rng_t &rng,
+                        std::vector<index_t> &out) {
+    // subtrees wholly inside the box, and leaves overlapping it
+    std::vector<index_t> frontier;
+    std::vector<uint64_t> prefix;
+    _sample_frontier(bb, frontier, prefix);
+    if (frontier.empty() || k == 0) {
+      return;
+    }
+    std::uniform_int_distribution<uint64_t> pick(0, prefix.back() - 1);
+    for (size_t s = 0; s < k; ++s) {
+      // choose a leaf by its rank and find which subtree holds it
+      uint64_t r = pick(rng);
+      const size_t f = size_t(std::upper_bound(prefix.begin(), prefix.end(), r) -
+                              prefix.begin());
+      r -= (f == 0) ? 0 : prefix[f - 1];
+      // then walk down to it using the counts
+      index_t i = frontier[f];
+      while (!_get(i).is_leaf()) {
+        ++_frame.query_nodes;
+        const node_t &c0 = _child(i, 0);
+        if (r < c0.count) {
+          i = _get(i).child[0];
+        }
+        else {
+          r -= c0.count;
+          i = _get(i).child[1];
+        }
+      }
+      out.push_back(i);
+    }
+  }
+
+  // find all leaves whose tight aabb a line segment hits, using the test
+  // of aabb_t::raycast()
   void raycast(float x0, float y0,
                float x1, float y1,
                std::vector<index_t> &overlaps);
 
+  // find all overlaps with many line segments. the rays are reordered to
+  // trace coherent packets together and results[i] holds the overlaps of
+  // rays[i] in the same order as raycast() would give.
+  void raycast_batch(const std::vector<ray_t> &rays,
+                     std::vector<std::vector<index_t>> &results);
+
+  // find all leaves whose tight aabb overlaps a circular sector. subtrees
+  // are culled on a conservative test and leaves are tested exactly.
+  void find_in_sector(const sector_t &sector, std::vector<index_t> &overlaps);
+
+  // find all overlaps with many sectors. sectors with nearby apexes share
+  // one walk of the tree and results[i] holds the overlaps of sectors[i] in
+  // the same order as find_in_sector() would give.
+  void find_in_sector_batch(const std::vector<sector_t> &sectors,
+                            std::vector<std::vector<index_t>> &results);
+
   // return a quality metric for this tree
   float quality() const {
     return _quality(_root);
   }
 
+  // number of nodes (leaf and interior) currently in the tree
+  size_t size() const {
+    return size_t(_num_nodes);
+  }
+
+  // maximum number of nodes the tree can hold
+  static size_t capacity() {
+    return _max_nodes;
+  }
+
+  // report the memory used by this tree
+  memory_usage_t memory_usage() const;
+
 protected:
 
+  // a node tagged with a spatial sort key
+  struct morton_t {
+    uint32_t code;
+    index_t index;
+
+    bool operator < (const morton_t &rhs) const {
+      return (code == rhs.code) ? (index < rhs.index) : (code < rhs.code);
+    }
+  };
+
   // bubble up tree recalculating aabbs
   void _recalc_aabbs(index_t);
 
+  // recalculate and optimize every ancestor of these nodes once
+  void _recalc_aabbs(const std::vector<index_t> &touched);
+
+  // recalculate an interior nodes aabbs from its children
+  void _refit(index_t i) {
+    node_t &node = _get(i);
+    const node_t &c0 = _child(i, 0);
+    const node_t &c1 = _child(i, 1);
+    node.aabb = aabb_t::find_union(c0.aabb, c1.aabb);
+    node.tight = aabb_t::find_union(c0.tight, c1.tight);
+    node.count = c0.count + c1.count;
+    node.asleep = c0.asleep && c1.asleep;
+    node.stamp = _epoch;
+    _keys[i] = std::max(_live_key(node.child[0]), _live_key(node.child[1]));
+  }
+
+  // key of a node, or minus infinity if nothing below it is alive
+  float _live_key(index_t i) const {
+    return _get(i).count ? _keys[i] : -std::numeric_limits<float>::infinity();
+  }
+
   // return a quality metric for this subtree
   float _quality(index_t) const;
 
@@ -169,14 +621,74 @@ protected:
   // sanity checks for the tree
   void _validate(index_t index);
 
+  // create a new unlinked leaf node
+  index_t _new_leaf(const aabb_t &aabb, void *user_data);
+
   // insert node into the tree
   void _insert(index_t node);
 
-  // find the best sibling leaf node for a given aabb
-  index_t _find_best_sibling(const aabb_t &aabb) const;
+  // link a leaf or subtree into the tree without recalculating aabbs,
+  // returning the node to recalculate from
+  index_t _link(index_t node);
+
+  // build a subtree over a morton sorted run of nodes
+  index_t _build(const morton_t *m, size_t count);
+
+  // link a morton sorted run of leaves into the tree, as local subtrees
+  // where they are densely clustered
+  void _graft(const morton_t *m, size_t count, std::vector<index_t> &touched);
+
+  // link a morton sorted run of new leaves into the tree, building the whole
+  // tree from them if it is empty
+  void _link_sorted(const morton_t *m, size_t count);
+
+  // find the best sibling leaf node for a given aabb, counting the nodes
+  // visited
+  index_t _find_best_sibling(const aabb_t &aabb, uint64_t &visits) const;
+
+  // find the node, leaf or interior, which would best take a subtree with
+  // the given aabb as its sibling, counting the nodes visited
+  index_t _find_best_node(const aabb_t &aabb, uint64_t &visits) const;
+
+  // pair 'node' with 'sib' under a new interior node
+  index_t _insert_beside(index_t sib, index_t node);
+
+  // remove marked leaves from a subtree, splicing out emptied interior nodes
+  // and refitting survivors. returns the new subtree root.
+  index_t _collapse(index_t i, const std::vector<uint8_t> &mark,
+                    std::vector<index_t> &freed);
 
-  // insert 'node' into 'leaf'
-  index_t _insert_into_leaf(index_t leaf, index_t node);
+  // build a new tree over these unlinked leaves
+  void _rebuild(const std::vector<index_t> &leaves);
+
+  // rebuild the subtree rooted at this node in place
+  void _rebuild_subtree(index_t i);
+
+  // check the largest subtrees below this node small enough to check for
+  // degradation, skipping any unchanged since epoch 'since'
+  void _find_degraded(index_t i, uint32_t since, float ratio,
+                      std::vector<index_t> &found);
+
+  // add this subtree to 'found' if its sah cost exceeds a rebuild by 'ratio'
+  void _check_degraded(index_t i, float ratio, std::vector<index_t> &found);
+
+  // note that the whole tree was just built, so nothing in it is degraded
+  void _mark_built();
+
+  // binned sah build over these leaves, taking interior nodes from 'pool'
+  index_t _build_binned(sah_leaf_t *leaves, size_t count,
+                        const index_t *&pool);
+
+  // prepare leaves for the binned sah builder
+  void _sah_leaves(const std::vector<index_t> &leaves,
+                   std::vector<sah_leaf_t> &out) const;
+
+  // take a sample for the growth tuner and adjust the growth
+  void _tune_growth(const frame_stats_t &f);
+
+  // collect the leaf and interior nodes of a subtree
+  void _gather(index_t root, std::vector<index_t> &leaves,
+               std::vector<index_t> &interior) const;
 
   // unlink this node from the tree but dont add it to the free list
   void _unlink(index_t index);
@@ -184,6 +696,13 @@ protected:
   // return true if a node is a leaf
   bool _is_leaf(index_t index) const;
 
+  // return true if a node is a leaf linked into the tree
+  bool _is_live_leaf(index_t index) const {
+    const node_t &node = _get(index);
+    return node.is_leaf() &&
+           (node.parent != invalid_index || index == _root);
+  }
+
   // access a node by index
   node_t &_get(index_t index) {
     assert(index != invalid_index);
@@ -207,17 +726,626 @@ protected:
   // allocate a new node from the free list
   index_t _new_node();
 
+  // a pair of subtrees to search for overlapping leaves, or all pairs within
+  // one subtree when a == b
+  struct pair_task_t {
+    index_t a, b;
+  };
+
+  // find overlaps with a box, adding to the given stats
+  void _find_overlaps(const aabb_t &bb, std::vector<index_t> &overlaps,
+                      frame_stats_t &stats) const;
+
+  // find the subtrees inside a box and the leaves overlapping it, with a
+  // running total of their live leaf counts
+  void _sample_frontier(const aabb_t &bb, std::vector<index_t> &frontier,
+                        std::vector<uint64_t> &prefix);
+
+  // split the search for overlapping pairs into tasks down to some depth
+  void _pair_tasks(index_t a, index_t b, uint32_t depth,
+                   std::vector<pair_task_t> &tasks) const;
+
+  // find the overlapping leaf pairs of one task, in traversal order
+  void _find_pairs(const pair_task_t &task,
+                   std::vector<std::pair<index_t, index_t>> &pairs,
+                   frame_stats_t &stats) const;
+
+  // add query stats gathered elsewhere to the current frame
+  void _merge_query_stats(const frame_stats_t &f);
+
+  // rasterize the rows [row0, row1) of a density grid
+  void _rasterize(const aabb_t &area, float *grid, int32_t w, int32_t h,
+                  int32_t row0, int32_t row1) const;
+
+  // update the asleep flag of a nodes ancestors after it changed
+  void _propagate_sleep(index_t i);
+
+  // grow the tight bounds of a node and its ancestors to cover 'slack'
+  // wherever they do not already cover 'aabb'
+  void _grow_tight(index_t i, const aabb_t &aabb, const aabb_t &slack);
+
+  // stamp a node and its ancestors with the current epoch
+  void _stamp(index_t i);
+
   // add a node to the free list
   void _free_node(index_t index);
 
+  // add many nodes to the free list at once
+  void _free_nodes(const std::vector<index_t> &indices);
+
   static const uint32_t _max_nodes = 1024 * 32;
 
   // free and taken bvh nodes
   std::array<node_t, _max_nodes> _nodes;
+  // priority key of each leaf, and the largest live key below each interior
+  // node. these are kept apart so a node still fits in one cache line.
+  std::array<float, _max_nodes> _keys;
+  // sah cost last measured for a subtree checked for degradation, and its
+  // leaf count at the time so a reused index is not mistaken for it
+  struct sah_ref_t {
+    float cost;
+    uint32_t leaves;
+  };
+  std::array<sah_ref_t, _max_nodes> _sah_refs;
   // start index of the free list
   index_t _free_list;
   // root node of the bvh
   index_t _root;
+  // number of nodes taken from the free list
+  index_t _num_nodes;
+  // leaves killed but not yet removed, which may since have been removed
+  std::vector<index_t> _dead;
+  // stamp given to nodes as they change
+  uint32_t _epoch;
+  // epoch ended by the last search for degraded subtrees or full build
+  uint32_t _checked_epoch;
+
+  // results of a delta query as of its last run
+  struct delta_query_t {
+    aabb_t bb;
+    // epoch in which the query last ran, zero if never
+    uint32_t epoch = 0;
+    // sorted leaves overlapping 'bb'
+    std::vector<index_t> result;
+  };
+
+  std::unordered_map<uint32_t, delta_query_t> _queries;
+
+  // cost model used to choose the maintenance each frame
+  struct policy_t {
+    // best quality seen since the last full rebuild
+    float reference_quality = 0.f;
+    // degradation at the end of the last frame
+    float last_degradation = 1.f;
+    // nodes visited per escape for refit and reinsert
+    float update_cost[2] = { 0.f, 0.f };
+    // relative quality loss per escape for refit and reinsert
+    float degrade[2] = { 0.f, 0.f };
+    // frames until degraded subtrees are searched for again
+    uint32_t cooldown = 0;
+  };
+
+  policy_t _policy;
+  // stats for the frame in progress
+  frame_stats_t _frame;
+  // stats for previous frames
+  std::vector<frame_stats_t> _history;
+  // stats for the last load
+  load_stats_t _load;
+
+  // state of the growth tuner
+  struct tuner_t {
+    // frames gathered into the current sample
+    uint32_t frames = 0;
+    uint64_t movers = 0;
+    uint64_t escapes = 0;
+    uint64_t leaf_hits = 0;
+    uint64_t false_positives = 0;
+    uint64_t update_nodes = 0;
+    uint64_t query_nodes = 0;
+  };
+
+  tuner_t _tuner;
+  // samples taken by the growth tuner
+  std::vector<growth_sample_t> _growth_history;
+};
+
+// an interior node of a packed_bvh_t holding the bounds of both children so
+// that a single cache line decides which to descend
+struct alignas(64) packed_node_t {
+
+  // bounds of each child
+  aabb_t bounds[2];
+
+  // index of each child node, or for a leaf the ones complement of its
+  // index in the leaf records
+  std::array<int32_t, 2> child;
+
+  static bool is_leaf(int32_t ref) {
+    return ref < 0;
+  }
+};
+
+// a leaf of a packed_bvh_t, holding only its payload
+struct packed_leaf_t {
+
+  // index of this leaf in the source tree
+  index_t index;
+
+  // packed node holding this leaf, or -1 for a lone leaf
+  int32_t parent;
+
+  // user provided data
+  void *user_data;
+};
+
+// a read only copy of a tree laid out for queries. interior nodes are stored
+// depth first with their childrens bounds inline, so testing a child does not
+// touch the childs own cache line. dead leaves are left out.
+struct packed_bvh_t {
+
+  packed_bvh_t();
+
+  // copy the current shape of a tree, replacing any previous contents
+  void build(const bvh_t &tree);
+
+  // find all leaves whose tight aabb overlaps a box, giving their index in
+  // the source tree. these are the same leaves as bvh_t::find_overlaps() finds.
+  void find_overlaps(const aabb_t &bb, std::vector<index_t> &overlaps) const;
+
+  const std::vector<packed_node_t> &nodes() const {
+    return _nodes;
+  }
+
+  const std::vector<packed_leaf_t> &leaves() const {
+    return _leaves;
+  }
+
+  // bytes held by the packed nodes and leaves
+  size_t memory() const {
+    return _nodes.capacity() * sizeof(packed_node_t) +
+           _leaves.capacity() * sizeof(packed_leaf_t);
+  }
+
+protected:
+
+  // pack a subtree depth first, returning a reference to it
+  int32_t _pack(const bvh_t &tree, index_t i, int32_t parent);
+
+  // bounds of a packed node or leaf
+  aabb_t _bounds(const bvh_t &tree, int32_t ref) const;
+
+  std::vector<packed_node_t> _nodes;
+  std::vector<packed_leaf_t> _leaves;
+  // reference to the root, either a node or a leaf
+  int32_t _root;
+  // bounds of the whole tree, as the root has no parent to hold them
+  aabb_t _root_bounds;
+  // set if there is nothing in the tree
+  bool _empty;
+};
+
+// number of numa nodes on this machine, or one without numa support
+size_t numa_nodes();
+
+// numa node of the cpu the calling thread is running on
+size_t current_numa_node();
+
+// restrict the calling thread to the cpus of a numa node and prefer memory
+// from that node, returning false if this is not possible
+bool run_on_numa_node(size_t node);
+
+// read only copies of a tree, one per numa node, each made by a thread
+// running on its node so that its pages are local to it. queries are routed
+// to the copy for the node of the calling thread, so no node is fetched
+// across sockets. with one node, or without numa support, there is a single
+// copy and routing is free.
+struct replicated_bvh_t {
+
+  // copy the current shape of a tree to every numa node, replacing any
+  // previous copies
+  void build(const bvh_t &tree);
+
+  // find all leaves whose tight aabb overlaps a box using the local copy
+  void find_overlaps(const aabb_t &bb, std::vector<index_t> &overlaps) const {
+    local().find_overlaps(bb, overlaps);
+  }
+
+  // the copy for the numa node of the calling thread
+  const packed_bvh_t &local() const;
+
+  // the copy held on a numa node
+  const packed_bvh_t &replica(size_t node) const {
+    assert(node < _replicas.size());
+    return _replicas[node];
+  }
+
+  // number of copies held
+  size_t replicas() const {
+    return _replicas.size();
+  }
+
+  // bytes held by every copy
+  size_t memory() const;
+
+protected:
+
+  // one copy per numa node
+  std::vector<packed_bvh_t> _replicas;
+};
+
+// yields the live leaves of a tree in order of increasing distance from a
+// point, using a best first walk over a priority queue of nodes and leaves
+// keyed by the distance to their tight aabbs. a leaf is given as soon as it
+// leaves the queue as nothing left in it can be any closer.
+// work is proportional to the number of leaves taken so the walk may stop at
+// any point. the tree must not change while it is in use.
+struct nearest_t {
+
+  nearest_t(const bvh_t &tree, float x, float y);
+
+  // get the next nearest leaf and its distance from the point to its tight
+  // aabb, returning false once every leaf has been given
+  bool next(index_t &index, float &distance);
+
+  // number of nodes taken from the queue so far
+  size_t visited() const {
+    return _visited;
+  }
+
+protected:
+
+  struct entry_t {
+    // squared distance to the tight aabb of the node or leaf
+    float dist;
+    index_t index;
+
+    // ordering for a min heap, with ties broken for a stable order
+    bool operator < (const entry_t &rhs) const {
+      if (dist != rhs.dist) return dist > rhs.dist;
+      return index > rhs.index;
+    }
+  };
+
+  // squared distance from the point to an aabb
+  float _distance(const aabb_t &aabb) const;
+
+  void _push(const entry_t &e);
+
+  const bvh_t &_tree;
+  float _x, _y;
+  std::vector<entry_t> _heap;
+  size_t _visited;
+};
+
+// index of a leaf in a paged_bvh_t, which is the position of its box in the
+// input. it is wider than index_t as paged trees may hold billions of boxes.
+typedef uint64_t paged_index_t;
+
+// a node of a paged_bvh_t, in the resident top levels or in a page, holding
+// the bounds of both children inline
+struct paged_node_t {
+
+  // bounds of each child
+  aabb_t bounds[2];
+
+  // index of each child node, or the ones complement of a page in the top
+  // levels or of a leaf within a page
+  std::array<int32_t, 2> child;
+};
+
+// a leaf held in a page of a paged_bvh_t
+struct paged_leaf_t {
+  aabb_t aabb;
+  paged_index_t index;
+};
+
+// page cache statistics of a paged_bvh_t
+struct page_stats_t {
+
+  // page requests served from the cache
+  uint64_t hits = 0;
+
+  // page requests which had to read the page from disk
+  uint64_t faults = 0;
+
+  // pages which could not be read or were corrupt. they are not cached and
+  // their leaves are missing from the results of the queries which hit them.
+  uint64_t errors = 0;
+
+  // fraction of page requests served from the cache
+  float hit_rate() const {
+    const uint64_t total = hits + faults;
+    return total ? float(double(hits) / double(total)) : 0.f;
+  }
+};
+
+// a static tree stored on disk in fixed size pages, for maps larger than
+// memory. each page holds a subtree over a morton ordered run of leaves and
+// the top levels above the pages stay resident, while pages are read on
+// demand into an lru cache. leaf i is the i-th box the tree was written
+// from. the file is in native byte order.
+struct paged_bvh_t {
+
+  paged_bvh_t();
+  ~paged_bvh_t();
+
+  paged_bvh_t(const paged_bvh_t &) = delete;
+  paged_bvh_t &operator = (const paged_bvh_t &) = delete;
+
+  // write a tree over some boxes to a file in pages of 'page_size' bytes,
+  // returning false if it could not be written or would need more pages
+  // than a top level node can refer to
+  static bool write(const char *path, const std::vector<aabb_t> &boxes,
+                    uint32_t page_size);
+
+  // write the same file as write() would over the boxes of a snapshot
+  // written by write_boxes(), holding no more than about 'memory' bytes of
+  // leaves at once. morton sorted runs are spilled to temporary files beside
+  // 'path' and merged straight into the pages. only the top levels, which
+  // open() reads in whole, are kept in memory until the end.
+  static bool write_external(const char *boxes, const char *path,
+                             uint32_t page_size, size_t memory);
+
+  // open a written tree, caching up to 'cache_pages' pages (at least one),
+  // returning false if it could not be read or its header and top levels
+  // do not fit the file
+  bool open(const char *path, size_t cache_pages);
+
+  // close the file and drop the cache
+  void close();
+
+  // find all leaves which overlap a given bounding-box, returning false if a
+  // page could not be read, in which case its leaves are missing
+  bool find_overlaps(const aabb_t &bb, std::vector<paged_index_t> &overlaps);
+
+  // find all leaves a line segment hits, returning false as above
+  bool raycast(float x0, float y0,
+               float x1, float y1,
+               std::vector<paged_index_t> &overlaps);
+
+  // number of leaves in the tree
+  uint64_t leaves() const {
+    return _leaves;
+  }
+
+  // number of pages in the file
+  uint64_t pages() const {
+    return _pages;
+  }
+
+  // statistics since the file was opened or reset_stats() was called
+  const page_stats_t &stats() const {
+    return _stats;
+  }
+
+  void reset_stats() {
+    _stats = page_stats_t();
+  }
+
+  // bytes held in memory by the top levels and the page cache
+  size_t memory() const {
+    return _top.capacity() * sizeof(paged_node_t) + _cache.capacity() +
+           _slot_page.capacity() * sizeof(uint64_t) +
+           _prev.capacity() * sizeof(uint32_t) * 2 +
+           _resident.size() * (sizeof(uint64_t) + sizeof(uint32_t));
+  }
+
+protected:
+
+  // walk the tree collecting the leaves passing 'test', returning false if
+  // a page could not be read
+  template <typename test_t>
+  bool _query(const test_t &test, std::vector<paged_index_t> &out);
+
+  // get a page through the cache, or null if it could not be read or is
+  // corrupt
+  const uint8_t *_page(uint64_t page);
+
+  // put a cache slot at the front of the lru list
+  void _link(uint32_t slot);
+
+  // remove a cache slot from the lru list
+  void _unlink(uint32_t slot);
+
+  // file descriptor, or -1 when closed
+  int _fd;
+  uint32_t _page_size;
+  uint64_t _leaves;
+  uint64_t _pages;
+  // resident top levels and the reference to the root
+  std::vector<paged_node_t> _top;
+  int32_t _root;
+  aabb_t _bounds;
+  // cached pages, one slot of _page_size bytes each
+  std::vector<uint8_t> _cache;
+  // page held in each slot
+  std::vector<uint64_t> _slot_page;
+  // lru list through the slots, most recent first
+  std::vector<uint32_t> _prev, _next;
+  uint32_t _head, _tail;
+  // slots in use
+  uint32_t _used;
+  // slot holding each cached page
+  std::unordered_map<uint64_t, uint32_t> _resident;
+  page_stats_t _stats;
+};
+
+// a node of a tree published by a shared_bvh_t, linked only by index
+struct shared_node_t {
+  // tight aabb of a leaf, or a bound on those of the leaves below
+  aabb_t tight;
+  // children, or invalid_index for a leaf
+  std::array<index_t, 2> child;
+  // number of live leaves in this subtree
+  uint32_t count;
+  uint32_t unused;
+};
+
+// publishes a tree to a named posix shared memory segment so that other
+// processes can query it through a shared_view_t. the segment holds two
+// copies of the nodes. each publish fills the copy readers are not using
+// with the nodes changed since that copy was last filled and then points
+// readers at it. a sequence count on each copy lets readers notice it being
+// refilled under them and retry, so readers take no locks and never hold up
+// the writer. the same tree must be given to every publish.
+struct shared_bvh_t {
+
+  shared_bvh_t();
+  ~shared_bvh_t();
+
+  shared_bvh_t(const shared_bvh_t &) = delete;
+  shared_bvh_t &operator = (const shared_bvh_t &) = delete;
+
+  // create a segment, replacing any of the same name. the name is as given
+  // to shm_open(), a slash followed by up to 254 characters.
+  bool create(const char *name);
+
+  // unmap and remove the segment. readers which have it open keep their
+  // mapping.
+  void close();
+
+  // copy the changes made to a tree into the spare copy and make it the
+  // version readers query, returning the new version. this ends the trees
+  // current epoch.
+  uint64_t publish(bvh_t &tree);
+
+  // version last published, or zero before the first
+  uint64_t version() const;
+
+  // nodes copied by the last publish
+  size_t copied() const {
+    return _copied;
+  }
+
+protected:
+
+  std::string _name;
+  uint8_t *_base;
+  size_t _size;
+  // epoch of the tree each copy was last brought up to, or zero if the copy
+  // has never been filled
+  uint32_t _epoch[2];
+  size_t _copied;
+};
+
+// a read only view of a tree published by a shared_bvh_t, usually in another
+// process. queries read the published nodes in place.
+struct shared_view_t {
+
+  shared_view_t();
+  ~shared_view_t();
+
+  shared_view_t(const shared_view_t &) = delete;
+  shared_view_t &operator = (const shared_view_t &) = delete;
+
+  // map a segment made by shared_bvh_t::create()
+  bool open(const char *name);
+
+  void close();
+
+  // find all leaves whose tight aabb overlaps a box in the latest published
+  // version, as bvh_t::find_overlaps() would have at that version, returning
+  // the version queried or zero if nothing has been published yet
+  uint64_t find_overlaps(const aabb_t &bb,
+                         std::vector<index_t> &overlaps) const;
+
+  // version last published by the writer
+  uint64_t version() const;
+
+  // queries started again because the writer refilled the copy they read
+  uint64_t retries() const {
+    return _retries.load(std::memory_order_relaxed);
+  }
+
+protected:
+
+  const uint8_t *_base;
+  size_t _size;
+  mutable std::atomic<uint64_t> _retries;
+};
+
+// a range of island_builder_t::bodies() forming one island
+struct island_t {
+  uint32_t begin, end;
+};
+
+// groups the leaves of a tree into islands, sets of leaves connected to each
+// other through overlapping pairs, using a concurrent union-find over leaf
+// indices. leaves in no pair belong to no island.
+struct island_builder_t {
+
+  island_builder_t();
+
+  // take the complete set of overlapping pairs for this frame, as given by
+  // bvh_t::find_pairs(), and update the islands using a number of threads
+  // (or one per core if zero). pairs which began since the last update are
+  // merged into the existing islands and only islands which lost a pair are
+  // split again.
+  void update(const std::vector<std::pair<index_t, index_t>> &pairs,
+              uint32_t threads);
+
+  // as above, given only the pairs which began and ended since the last
+  // update. this avoids diffing the whole pair set against the last one.
+  void update(const std::vector<std::pair<index_t, index_t>> &began,
+              const std::vector<std::pair<index_t, index_t>> &ended,
+              uint32_t threads);
+
+  // forget all pairs and islands
+  void clear();
+
+  // leaves grouped so that each island is a contiguous range. within an
+  // island leaves are in index order and islands are ordered by their
+  // lowest leaf index.
+  const std::vector<index_t> &bodies() const {
+    return _bodies;
+  }
+
+  // the islands, as ranges of bodies()
+  const std::vector<island_t> &islands() const {
+    return _islands;
+  }
+
+  // the island a leaf belongs to, identified by its lowest leaf index
+  index_t find(index_t i) const;
+
+protected:
+
+  // update the islands for pairs which began and ended, with _pairs
+  // already holding the new set of pairs
+  void _apply(const std::vector<std::pair<index_t, index_t>> &began,
+              const std::vector<std::pair<index_t, index_t>> &ended,
+              uint32_t threads);
+
+  // find the root of a leaf, halving the path to it as it goes
+  index_t _find(index_t i);
+
+  // merge the islands of two leaves
+  void _unite(index_t a, index_t b);
+
+  // merge the islands of every pair whose first leaf passes 'filter'
+  template <typename filter_t>
+  void _unite_all(const std::vector<std::pair<index_t, index_t>> &pairs,
+                  uint32_t threads, filter_t &&filter);
+
+  // group the leaves by island
+  void _emit();
+
+  // union-find parent of each leaf. a root is always the lowest index in its
+  // island, so the result does not depend on the order of the unions.
+  std::vector<std::atomic<index_t>> _parent;
+  // number of pairs each leaf is part of
+  std::vector<uint32_t> _degree;
+  // island each leaf was in after the last update
+  std::vector<uint32_t> _island_of;
+  // leaves being linked again after their island was taken apart
+  std::vector<uint8_t> _reset;
+  // sorted pairs from the last update
+  std::vector<std::pair<index_t, index_t>> _pairs;
+  // leaves grouped by island
+  std::vector<index_t> _bodies;
+  // ranges of _bodies
+  std::vector<island_t> _islands;
 };
 
 } // namespace bvh